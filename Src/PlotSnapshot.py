@@ -0,0 +1,30 @@
+from TestsScriptBase import *
+
+import matplotlib.pyplot as plt
+
+# Plots a layer snapshot written by energy_storms_omp -x. For a pyramid the
+# level with at most max_bins bins is drawn, with its min/max band.
+def plot_layer_snapshot(plot_name, snapshot, max_bins = 2000):
+    figure, layerPlt = plt.subplots(1, figsize=(12,5))
+
+    layerPlt.set_title("Storm: " + str(snapshot.storm) + " Layer size: " + str(snapshot.layer_size))
+    layerPlt.set_xlabel("Cell")
+    layerPlt.set_ylabel("Energy")
+
+    if snapshot.layer is not None:
+        layerPlt.plot(range(snapshot.layer_size), snapshot.layer, color="blue")
+    else:
+        level = next(l for l in snapshot.levels if len(l.mean) <= max_bins)
+        cells = [b * level.bin_size for b in range(len(level.mean))]
+        layerPlt.fill_between(cells, level.minimum, level.maximum, color="lightblue", label = "Min/Max")
+        layerPlt.plot(cells, level.mean, color="blue", label = "Mean")
+        layerPlt.legend(loc='upper right')
+
+    plt.savefig(PLOTS_FOLDER + plot_name)
+    plt.close()
+
+##MAIN##
+
+plot_name = sys.argv[1]
+
+plot_layer_snapshot(plot_name, LayerSnapshot(sys.argv[2]))
@@ -1,11 +1,12 @@
 from TestsScriptBase import *
 import getopt
 
-opargs, args = getopt.getopt(sys.argv[1:], "t:l:h:")
+opargs, args = getopt.getopt(sys.argv[1:], "t:l:h:a:")
 
 n_threads = 1
 layer_size = 0
 threshold = 0.001
+seq_options = []
 
 for opt in opargs:
     if(opt[0] == "-t"):
@@ -14,6 +15,9 @@ for opt in opargs:
         layer_size = int(opt[1])
     elif(opt[0] == "-h"):
         threshold = float(opt[1])
+    elif(opt[0] == "-a"):
+        os.makedirs(opt[1], exist_ok=True)
+        seq_options = ["-a", opt[1]]
 
 if(layer_size <= 0):
     print("Specify valid layer size! (ex: -l 1000)")
@@ -31,7 +35,7 @@ test_files = args
 
 print("Running original program")
 seqSample = start_energy_storms_program(ENERGY_STORMS_SEQ_EXEC,
-                layer_size, test_files, threshold=threshold)
+                layer_size, test_files, threshold=threshold, options=seq_options)
 
 print("Running OMP program")
 ompSample = start_energy_storms_program(ENERGY_STORMS_OMP_EXEC,
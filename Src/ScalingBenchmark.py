@@ -0,0 +1,125 @@
+from TestsScriptBase import *
+import getopt
+#################MAIN##################
+
+# Strong scaling: the same workload with 1, 2, 4, ... threads.
+# Weak scaling: the layer size grows with the number of threads, so the
+# work per thread is the same (the bombardment and the relaxation are
+# proportional to the layer size). The sequential program is run once per
+# point of the weak scaling, its time grows with the number of threads.
+
+opargs, args = getopt.getopt(sys.argv[1:], "h:l:p:w:d:n:t:")
+
+layer_size = 100000
+particles = 1000
+waves = 2
+distribution = "uniform"
+threshold = 0.001
+n_runs = 3
+max_threads = os.cpu_count()
+
+STRONG_SCALING_OUT_FILE = "strong_scaling.csv"
+WEAK_SCALING_OUT_FILE = "weak_scaling.csv"
+
+for opt in opargs:
+    if(opt[0] == "-l"):
+        layer_size = int(opt[1])
+    elif(opt[0] == "-p"):
+        particles = int(opt[1])
+    elif(opt[0] == "-w"):
+        waves = int(opt[1])
+    elif(opt[0] == "-d"):
+        distribution = opt[1]
+    elif(opt[0] == "-h"):
+        threshold = float(opt[1])
+    elif(opt[0] == "-n"):
+        n_runs = int(opt[1])
+    elif(opt[0] == "-t"):
+        max_threads = int(opt[1])
+
+if(layer_size <= 0 or particles <= 0 or waves <= 0):
+    print("Specify valid layer size, particles and waves! (ex: -l 1000 -p 100 -w 2)")
+    exit(1)
+
+if(threshold <= 0.0):
+    print("Specify valid threshold!")
+    exit(1)
+
+if(n_runs <= 0 or max_threads <= 0):
+    print("Specify valid number of runs and threads!")
+    exit(1)
+
+threads = [1]
+while threads[-1] * 2 <= max_threads:
+    threads.append(threads[-1] * 2)
+
+def run_samples(program, layer_size, test_files, n_threads = 1, runs = n_runs):
+    return [start_energy_storms_program(program, layer_size, test_files,
+                n_threads, threshold=threshold) for _ in range(runs)]
+
+def check_results(seqSample, samples):
+    for sample in samples:
+        if not seqSample.compareResults(sample):
+            print(RED + "Output mismatch! Differences:" + DEFAULT_COLOR)
+            seqSample.printAll("Sample1_out.txt")
+            sample.printAll("Sample2_out.txt")
+            subprocess.run(["diff", "Sample1_out.txt", "Sample2_out.txt"])
+            os.remove(CSV_FILENAME)
+            print(RED + "Aborting script..." + DEFAULT_COLOR)
+            exit(1)
+
+def mean_time(samples):
+    return mean([s.time for s in samples])
+
+def export_scaling_csv(file_name, rows):
+    with open(file_name, 'w', newline='') as csvfile:
+        writer = csv.writer(csvfile, delimiter=',', quoting=csv.QUOTE_MINIMAL)
+        writer.writerow(["distribution", distribution])
+        writer.writerow(["particles", str(particles)])
+        writer.writerow(["waves", str(waves)])
+        writer.writerow(["threshold", str(threshold)])
+        writer.writerow([])
+        writer.writerow(["n_threads", "layer_size", "seq_time", "omp_time", "speed_up", "efficiency", "relative_efficiency"])
+        for row in rows:
+            writer.writerow([str(v) for v in row])
+
+print("Strong scaling")
+test_files = generate_storm_files(layer_size, particles, waves, distribution)
+seqSamples = run_samples(ENERGY_STORMS_SEQ_EXEC, layer_size, test_files)
+seqTime = mean_time(seqSamples)
+rows = []
+ompTime1 = None
+for t in threads:
+    print(BLUE + str(t) + " thread(s)" + DEFAULT_COLOR)
+    ompSamples = run_samples(ENERGY_STORMS_OMP_EXEC, layer_size, test_files, t)
+    check_results(seqSamples[0], ompSamples)
+    ompTime = mean_time(ompSamples)
+    if ompTime1 is None:
+        ompTime1 = ompTime
+    speedUp = seqTime/ompTime
+    # The efficiency relative to the OMP program with one thread
+    rows.append([t, layer_size, seqTime, ompTime, speedUp, speedUp/t, ompTime1/(t*ompTime)])
+export_scaling_csv(STRONG_SCALING_OUT_FILE, rows)
+
+print("Weak scaling")
+rows = []
+ompTime1 = None
+for t in threads:
+    print(BLUE + str(t) + " thread(s)" + DEFAULT_COLOR)
+    size = layer_size * t
+    test_files = generate_storm_files(size, particles, waves, distribution)
+    seqSamples = run_samples(ENERGY_STORMS_SEQ_EXEC, size, test_files, runs = 1)
+    seqTime = mean_time(seqSamples)
+    ompSamples = run_samples(ENERGY_STORMS_OMP_EXEC, size, test_files, t)
+    check_results(seqSamples[0], ompSamples)
+    ompTime = mean_time(ompSamples)
+    if ompTime1 is None:
+        ompTime1 = ompTime
+    speedUp = seqTime/ompTime
+    # The time with one thread over the time with t threads and t times the work
+    rows.append([t, size, seqTime, ompTime, speedUp, speedUp/t, ompTime1/ompTime])
+export_scaling_csv(WEAK_SCALING_OUT_FILE, rows)
+
+print(GREEN + "Scaling benchmark complete!" + DEFAULT_COLOR)
+
+os.remove(CSV_FILENAME)
@@ -35,6 +35,12 @@ run_tests(layer_size, get_test_files("test_07_*"), n_runs = N_RUNS)
 print("Using all test_08_* files")
 run_tests(layer_size, get_test_files("test_08_*"), n_runs = N_RUNS)
 
+# The engines are compared with the layer size of each group of test files
+for size, files in [(35, "test_01_*"), (30000, "test_02_a30k_p20k_w[12]"), (20, "test_0[3-6]_*"),
+                    (17, "test_09_*"), (1000000, "test_07_a1M_p5k_w1"), (100000000, "test_08_*")]:
+    print("Testing the engines with", files, "files")
+    run_engine_tests(size, get_test_files(files))
+
 
 print(GREEN + "Test complete!",)
 
@@ -4,6 +4,8 @@ import re
 import sys
 import csv
 import signal
+import struct
+from array import array
 
 from statistics import mean
 
@@ -22,14 +24,41 @@ PLOTS_FOLDER = "plots/"
 
 ENERGY_STORMS_OMP_EXEC = "./energy_storms_omp"
 ENERGY_STORMS_SEQ_EXEC = "./energy_storms_seq"
+STORM_GENERATOR_EXEC = "./storm_generator"
+
+GENERATED_FILES_FOLDER = "generated_files/"
+
+# Result cache of the reference runs of energy_storms_seq (-a), they are not timed
+SEQ_CACHE_FOLDER = "seq_cache/"
 
 SEQ_STATS_OUT_FILE = "seq.csv"
 OMP_STATS_OUT_FILE = "omp.csv"
 
 #MAX_THREADS = os.cpu_count()
 
+# Engines of energy_storms_omp compared against energy_storms_seq by
+# run_engine_tests(): options and relative tolerance of the results. The
+# pipelined engine adds the energies of a storm together before adding them
+# to the layer, so its results can differ in the last digits
+ENGINE_TESTS = [
+    ([], 0.0),
+    (["-b", "4"], 0.0),
+    (["-p", "1"], 1e-5),
+]
+
+# Local maxima reported by the -k runs of run_engine_tests(). Up to this
+# layer size they are checked against the layers exported after each storm
+TOP_MAXIMA_K = 3
+TOP_MAXIMA_CHECK_MAX_SIZE = 1000000
+TOP_MAXIMA_SNAPSHOT_PREFIX = ".top_maxima"
+
+# Checkpoint saved by the first half of the files and resumed by the rest (-s, -r)
+CHECKPOINT_FILENAME = ".checkpoint.bin"
+RESUME_TESTS = [[], ["-b", "4"]]
+
 class ProgramResultsSample:
-    def __init__(self, program, layer_size, n_threads, test_files, time, results, threshold):
+    def __init__(self, program, layer_size, n_threads, test_files, time, results, threshold,
+                options = [], top_maxima = []):
         self.program    = program
         self.time       = time
         self.threshold  = threshold
@@ -38,6 +67,8 @@ class ProgramResultsSample:
         self.n_threads  = n_threads
         self.test_files = test_files
         self.stderr_out = None
+        self.options    = options
+        self.top_maxima = top_maxima
 
     def printAll(self, towrite=sys.stdout):
         oldstdout = sys.stdout
@@ -49,22 +80,30 @@ class ProgramResultsSample:
         print("Layer size: ",   self.layer_size)
         print("Threshold: ",    self.threshold)
         print("Threads: ",      self.n_threads)
+        print("Options: ",      " ".join(self.options))
         print("Test files:\n")
         for t in self.test_files:
             print(t)
         print("Results:\n")
         for r in self.results:
             print(r[0], r[1])
+        if self.top_maxima != []:
+            print("Top maxima:\n")
+            for m in self.top_maxima:
+                print(" ".join(m))
 
         if(sys.stdout != oldstdout):
             sys.stdout.close()
             sys.stdout = oldstdout
 
-    def compareResults(self, other):
-        if self.layer_size != other.layer_size:
+    def compareResults(self, other, tolerance = 0.0):
+        if self.layer_size != other.layer_size or len(self.results) != len(other.results):
             return False
         for i, r in enumerate(self.results):
-            if r[1] != other.results[i][1]:
+            if tolerance == 0.0:
+                if r[1] != other.results[i][1]:
+                    return False
+            elif abs(float(r[1]) - float(other.results[i][1])) > tolerance * abs(float(r[1])):
                 return False
         
         return True
@@ -163,6 +202,41 @@ class SamplesStats:
 
         return obj
 
+class LayerSnapshot:
+    # Header of the snapshot files of energy_storms_omp (-x): magic, version,
+    # storm, layer_size, minL, maxL, block, levels
+    HEADER_FORMAT = "4s7i"
+
+    def __init__(self, file_name):
+        with open(file_name, "rb") as snap_file:
+            header = snap_file.read(struct.calcsize(self.HEADER_FORMAT))
+            (magic, version, self.storm, self.layer_size, self.minL, self.maxL,
+                self.block, n_levels) = struct.unpack(self.HEADER_FORMAT, header)
+            assert magic == b"ESSN" and version == 1
+
+            # Raw layer when block is 0, otherwise a list of levels
+            self.layer = None
+            self.levels = []
+
+            if self.block == 0:
+                self.layer = array("f")
+                self.layer.fromfile(snap_file, self.layer_size)
+            else:
+                for _ in range(n_levels):
+                    bins, bin_size = struct.unpack("2i", snap_file.read(8))
+                    minimum, maximum, mean = array("f"), array("f"), array("f")
+                    minimum.fromfile(snap_file, bins)
+                    maximum.fromfile(snap_file, bins)
+                    mean.fromfile(snap_file, bins)
+                    self.levels.append(SnapshotLevel(bin_size, minimum, maximum, mean))
+
+class SnapshotLevel:
+    def __init__(self, bin_size, minimum, maximum, mean):
+        self.bin_size = bin_size
+        self.minimum  = minimum
+        self.maximum  = maximum
+        self.mean     = mean
+
 def get_test_files(regex_expr = "test_*"):
     test_files_folder = os.listdir("test_files/")
 
@@ -176,7 +250,24 @@ def get_test_files(regex_expr = "test_*"):
 
     return test_files
 
-def start_energy_storms_program(program, layer_size, test_files, n_threads = 1, threshold=0.001):
+def generate_storm_files(layer_size, particles, waves, distribution = "uniform", seed = 1):
+    os.makedirs(GENERATED_FILES_FOLDER, exist_ok=True)
+
+    storm_files = []
+
+    for w in range(waves):
+        file_name = GENERATED_FILES_FOLDER + "storm_%s_l%d_p%d_w%d" % (distribution, layer_size, particles, w + 1)
+        proc = subprocess.run([STORM_GENERATOR_EXEC, "-d", distribution, "-s", str(seed + w),
+                            str(layer_size), str(particles), file_name])
+        if proc.returncode != 0:
+            print(RED + "Error while generating", file_name, "! Aborting script..." + DEFAULT_COLOR)
+            exit(1)
+        storm_files.append(file_name)
+
+    return storm_files
+
+def start_energy_storms_program(program, layer_size, test_files, n_threads = 1, threshold=0.001,
+    options = []):
     def parse_results():
         output_arr = []
         with open(CSV_FILENAME, "r") as csv_file:
@@ -189,8 +280,16 @@ def start_energy_storms_program(program, layer_size, test_files, n_threads = 1,
 
         time = float(output_arr[0][1])
         results = output_arr[2:]
+        top_maxima = []
 
-        results = ProgramResultsSample(program, layer_size, n_threads, test_files, time, results, threshold)
+        # The local maxima of -k follow the results
+        if ["Top maxima:"] in results:
+            top = results.index(["Top maxima:"])
+            top_maxima = results[top + 1:]
+            results = results[:top]
+
+        results = ProgramResultsSample(program, layer_size, n_threads, test_files, time, results, threshold,
+                    options, top_maxima)
 
         return results
 
@@ -200,10 +299,10 @@ def start_energy_storms_program(program, layer_size, test_files, n_threads = 1,
 
     if(program == ENERGY_STORMS_OMP_EXEC):
         proc = subprocess.run([program, "-c", CSV_FILENAME, "-h", str(threshold),
-                            "-t", str(n_threads), str(layer_size)] + test_files)
+                            "-t", str(n_threads)] + options + [str(layer_size)] + test_files)
     elif(program == ENERGY_STORMS_SEQ_EXEC):
-        proc = subprocess.run([program, "-c", CSV_FILENAME, "-h", str(threshold), 
-                            str(layer_size)] + test_files)
+        proc = subprocess.run([program, "-c", CSV_FILENAME, "-h", str(threshold)] + options +
+                            [str(layer_size)] + test_files)
     else:
         assert False
 
@@ -259,6 +358,83 @@ def run_tests(layer_size, test_files, n_runs = 2,
             
     return SEQsamples, OMPsamples
 
+def run_engine_tests(layer_size, test_files, n_threads = 4, threshold=0.001, cache_dir = SEQ_CACHE_FOLDER):
+    def _snapshotTopMaxima(num_storms):
+        # The K highest local maxima of the layer after each storm, in the order of -k
+        top_maxima = []
+        for storm in range(num_storms):
+            file_name = "%s_%d.bin" % (TOP_MAXIMA_SNAPSHOT_PREFIX, storm)
+            snapshot = LayerSnapshot(file_name)
+            os.remove(file_name)
+
+            layer = snapshot.layer
+            maxima = [(layer[k], k) for k in range(snapshot.minL + 1, snapshot.maxL - 1)
+                        if layer[k] > layer[k - 1] and layer[k] > layer[k + 1]]
+            maxima.sort(key = lambda m: (-m[0], m[1]))
+            for rank, (value, position) in enumerate(maxima[:TOP_MAXIMA_K]):
+                top_maxima.append([str(storm), str(rank + 1), str(position), "%f" % value])
+        return top_maxima
+
+    def _checkMatch(match, sample, other):
+        if not match:
+            print(RED + "Output mismatch! Differences:" + DEFAULT_COLOR)
+            sample.printAll("Sample1_out.txt")
+            other.printAll("Sample2_out.txt")
+            subprocess.run(["diff", "Sample1_out.txt", "Sample2_out.txt"])
+            os.remove(CSV_FILENAME)
+            print(RED + "Aborting script..." + DEFAULT_COLOR)
+            exit(1)
+
+    seqOptions = []
+    if cache_dir != None:
+        os.makedirs(cache_dir, exist_ok=True)
+        seqOptions = ["-a", cache_dir]
+
+    seqSample = start_energy_storms_program(ENERGY_STORMS_SEQ_EXEC, layer_size, test_files,
+                    threshold=threshold, options=seqOptions)
+
+    for options, tolerance in ENGINE_TESTS:
+        print("Testing OMP program with options:", " ".join(options))
+        ompSample = start_energy_storms_program(ENERGY_STORMS_OMP_EXEC, layer_size, test_files,
+                        n_threads=n_threads, threshold=threshold, options=options)
+
+        _checkMatch(seqSample.compareResults(ompSample, tolerance), seqSample, ompSample)
+
+    # The local maxima of the storm by storm engine are checked against its
+    # layers, and the runs with one thread and with -b must report the same
+    topOptions = ["-k", str(TOP_MAXIMA_K)]
+    checkLayers = layer_size <= TOP_MAXIMA_CHECK_MAX_SIZE
+
+    print("Testing OMP program with options:", " ".join(topOptions))
+    topSample = start_energy_storms_program(ENERGY_STORMS_OMP_EXEC, layer_size, test_files,
+                    n_threads=n_threads, threshold=threshold,
+                    options=topOptions + (["-x", TOP_MAXIMA_SNAPSHOT_PREFIX] if checkLayers else []))
+    _checkMatch(seqSample.compareResults(topSample), seqSample, topSample)
+
+    if checkLayers:
+        expected = ProgramResultsSample(ENERGY_STORMS_OMP_EXEC, layer_size, n_threads, test_files, 0.0,
+                        topSample.results, threshold, topOptions, _snapshotTopMaxima(len(topSample.results)))
+        _checkMatch(expected.top_maxima == topSample.top_maxima, expected, topSample)
+
+    for threads, options in [(1, []), (n_threads, ["-b", "4"])]:
+        print("Testing OMP program with options:", " ".join(topOptions + options), "and", threads, "thread(s)")
+        ompSample = start_energy_storms_program(ENERGY_STORMS_OMP_EXEC, layer_size, test_files,
+                        n_threads=threads, threshold=threshold, options=topOptions + options)
+        _checkMatch(seqSample.compareResults(ompSample) and ompSample.top_maxima == topSample.top_maxima,
+                        topSample, ompSample)
+
+    # The resumed run prints the results of the storms of the checkpoint too
+    half = len(test_files) // 2
+    if half > 0:
+        for options in RESUME_TESTS:
+            print("Testing OMP program resuming with options:", " ".join(options))
+            start_energy_storms_program(ENERGY_STORMS_OMP_EXEC, layer_size, test_files[:half],
+                n_threads=n_threads, threshold=threshold, options=options + ["-s", CHECKPOINT_FILENAME])
+            ompSample = start_energy_storms_program(ENERGY_STORMS_OMP_EXEC, layer_size, test_files[half:],
+                            n_threads=n_threads, threshold=threshold, options=options + ["-r", CHECKPOINT_FILENAME])
+            os.remove(CHECKPOINT_FILENAME)
+            _checkMatch(seqSample.compareResults(ompSample), seqSample, ompSample)
+
 def export_results_stats(SEQSamples, OMPSamples, layer_size, threshold, threads):
     SEQStats = SamplesStats(SEQSamples, ENERGY_STORMS_SEQ_EXEC, layer_size, threshold, [1])
 
@@ -19,6 +19,9 @@
 #include<math.h>
 #include<sys/time.h>
 #include<getopt.h>
+#include<string.h>
+#include<unistd.h>
+#include<sys/stat.h>
 
 typedef enum { FALSE, TRUE } boolean;
 
@@ -137,11 +140,15 @@ Storm read_storm_file( char *fname ) {
 
 boolean csv = FALSE;
 
+/* Directory of the result cache (-a), and storage of the layer in its entries (-l) */
+char *cache_dir = NULL;
+boolean cache_layer = FALSE;
+
 short processOptions(int argc, char *argv[])
 {
 	short optargc = 0;
     char c;
-    while((c = getopt(argc, argv, "c:h:")) != -1)
+    while((c = getopt(argc, argv, "c:h:a:l")) != -1)
     {
         switch(c)
         {
@@ -162,6 +169,18 @@ short processOptions(int argc, char *argv[])
                 optargc++;
                 break;
             }
+            case 'a': case 'A':
+            {
+                cache_dir = optarg;
+
+                optargc++;
+                break;
+            }
+            case 'l': case 'L':
+            {
+                cache_layer = TRUE;
+                break;
+            }
         }
 
 		optargc++;
@@ -169,6 +188,160 @@ short processOptions(int argc, char *argv[])
 	return optargc;
 }
 
+/*
+ * Result cache (-a directory, -l to store the layer too), the same scheme
+ * as energy_storms_omp. An entry is named after a hash of the layer size,
+ * the threshold and the contents of the storms, and stores the maximum of
+ * every storm. With the layer, it also serves a longer list of storms that
+ * starts with the same storms. A second hash of the inputs, stored in the
+ * entry, is checked before using it.
+ */
+#define CACHE_MAGIC "ESCS"
+#define CACHE_VERSION 2
+#define CACHE_KEY_SEED 0xcbf29ce484222325ULL
+#define CACHE_CHECK_SEED 0x84222325cbf29ce4ULL
+
+typedef struct {
+    char magic[4];
+    int version;
+    int layer_size;
+    int num_storms;
+    double threshold;
+    unsigned long long check;
+    int has_layer;
+    int minL, maxL; // Range of the stored layer, the other cells are zero
+} CacheHeader;
+
+/* FNV-1a hash */
+unsigned long long hash_bytes( unsigned long long hash, const void *data, size_t bytes ) {
+    const unsigned char *byte = (const unsigned char *)data;
+    size_t b;
+    for ( b=0; b<bytes; b++ ) {
+        hash ^= byte[b];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * Function: Compute the keys and checks of the cache entries of each prefix of the storms
+ */
+void cache_keys( int layer_size, Storm *storms, int num_storms,
+        unsigned long long *key, unsigned long long *check ) {
+    char *program = "energy_storms_seq";
+    int version = CACHE_VERSION;
+    unsigned long long k = CACHE_KEY_SEED, c = CACHE_CHECK_SEED;
+    int i;
+
+    k = hash_bytes( k, program, strlen(program) );
+    k = hash_bytes( k, &version, sizeof(version) );
+    k = hash_bytes( k, &layer_size, sizeof(layer_size) );
+    /* The default threshold is the float 0.001f, the same entry serves -h 0.001 */
+    float key_threshold = (float)threshold;
+    k = hash_bytes( k, &key_threshold, sizeof(key_threshold) );
+    c = hash_bytes( c, &k, sizeof(k) );
+
+    for ( i=0; i<num_storms; i++ ) {
+        k = hash_bytes( k, &storms[i].size, sizeof(storms[i].size) );
+        k = hash_bytes( k, storms[i].posval, sizeof(int) * storms[i].size * 2 );
+        c = hash_bytes( c, &storms[i].size, sizeof(storms[i].size) );
+        c = hash_bytes( c, storms[i].posval, sizeof(int) * storms[i].size * 2 );
+        key[i] = k;
+        check[i] = c;
+    }
+}
+
+/*
+ * Function: Find the entry of the longest cached prefix of the storms, and read
+ * its maxima. Returns the number of cached storms, and the entry positioned at
+ * the layer range in fcache
+ */
+int lookup_cache( int layer_size, int num_storms, unsigned long long *key,
+        unsigned long long *check, float *maximum, int *positions, FILE **fcache,
+        CacheHeader *cached ) {
+    char name[ strlen(cache_dir) + 24 ];
+    CacheHeader header;
+    int i;
+
+    for ( i=num_storms-1; i>=0; i-- ) {
+        sprintf( name, "%s/%016llx.esc", cache_dir, key[i] );
+        *fcache = fopen( name, "rb" );
+        if ( *fcache == NULL ) continue;
+
+        /* A prefix can only be resumed from its layer */
+        if ( fread( &header, sizeof(header), 1, *fcache ) == 1
+                && memcmp( header.magic, CACHE_MAGIC, sizeof(header.magic) ) == 0
+                && header.version == CACHE_VERSION && header.check == check[i]
+                && header.num_storms == i+1 && header.layer_size == layer_size
+                && (float)header.threshold == (float)threshold
+                && ( header.has_layer || i == num_storms-1 )
+                && header.minL >= 0 && header.minL <= header.maxL && header.maxL <= layer_size
+                && fread( maximum, sizeof(float), i+1, *fcache ) == i+1
+                && fread( positions, sizeof(int), i+1, *fcache ) == i+1 ) {
+            *cached = header;
+            return i+1;
+        }
+
+        fclose( *fcache );
+    }
+    *fcache = NULL;
+    return 0;
+}
+
+/*
+ * Function: Store the results of the simulation in the cache. The results
+ * are already printed, so a failure is only reported
+ */
+void store_cache( unsigned long long key, unsigned long long check, float *layer,
+        int layer_size, float *maximum, int *positions, int num_storms ) {
+    char name[ strlen(cache_dir) + 24 ], tmp_name[ strlen(cache_dir) + 32 ];
+    sprintf( name, "%s/%016llx.esc", cache_dir, key );
+    sprintf( tmp_name, "%s.XXXXXX", name );
+
+    /* Written to a temporary file of this run and renamed, a reader never sees a partial entry */
+    int fd = mkstemp( tmp_name );
+    FILE *fcache = fd < 0 ? NULL : fdopen( fd, "wb" );
+    if ( fcache == NULL ) {
+        if ( fd >= 0 ) {
+            close( fd );
+            unlink( tmp_name );
+        }
+        fprintf(stderr,"Warning: Creating cache entry %s\n", name );
+        return;
+    }
+    fchmod( fd, 0644 );
+
+    CacheHeader header;
+    memset( &header, 0, sizeof(header) );
+    memcpy( header.magic, CACHE_MAGIC, sizeof(header.magic) );
+    header.version = CACHE_VERSION;
+    header.layer_size = layer_size;
+    header.num_storms = num_storms;
+    header.threshold = threshold;
+    header.check = check;
+    header.has_layer = cache_layer;
+
+    /* Only the range of the layer reached by the particles is stored */
+    int minL = 0, maxL = 0;
+    if ( cache_layer ) {
+        maxL = layer_size;
+        while ( minL < maxL && layer[minL] == 0.0f ) minL++;
+        while ( maxL > minL && layer[maxL-1] == 0.0f ) maxL--;
+    }
+    header.minL = minL;
+    header.maxL = maxL;
+
+    boolean written = fwrite( &header, sizeof(header), 1, fcache ) == 1
+            && fwrite( maximum, sizeof(float), num_storms, fcache ) == num_storms
+            && fwrite( positions, sizeof(int), num_storms, fcache ) == num_storms
+            && fwrite( &layer[minL], sizeof(float), maxL-minL, fcache ) == maxL-minL;
+
+    if ( fclose( fcache ) != 0 || !written || rename( tmp_name, name ) != 0 ) {
+        unlink( tmp_name );
+        fprintf(stderr,"Warning: Storing cache entry %s\n", name );
+    }
+}
+
 
 /*
  * MAIN PROGRAM
@@ -209,23 +382,42 @@ int main(int argc, char *argv[]) {
         positions[i] = 0;
     }
 
+    /* 1.4. Serve the longest cached prefix of the storms, only the rest are simulated */
+    unsigned long long cache_key[ num_storms ], cache_check[ num_storms ];
+    FILE *fcache = NULL;
+    CacheHeader cached;
+    int cached_storms = 0;
+    if ( cache_dir != NULL && num_storms > 0 ) {
+        cache_keys( layer_size, storms, num_storms, cache_key, cache_check );
+        cached_storms = lookup_cache( layer_size, num_storms, cache_key, cache_check,
+                maximum, positions, &fcache, &cached );
+    }
+
     /* 2. Begin time measurement */
     double ttotal = cp_Wtime();
 
     /* START: Do NOT optimize/parallelize the code of the main program above this point */
 
-    /* 3. Allocate memory for the layer and initialize to zero */
-    float *layer = (float *)malloc( sizeof(float) * layer_size );
-    float *layer_copy = (float *)malloc( sizeof(float) * layer_size );
+    /* 3. Allocate memory for the layer, initialized to zero by calloc */
+    float *layer = (float *)calloc( layer_size, sizeof(float) );
+    float *layer_copy = (float *)calloc( layer_size, sizeof(float) );
     if ( layer == NULL || layer_copy == NULL ) {
         fprintf(stderr,"Error: Allocating the layer memory\n");
         exit( EXIT_FAILURE );
     }
-    for( k=0; k<layer_size; k++ ) layer[k] = 0.0f;
-    for( k=0; k<layer_size; k++ ) layer_copy[k] = 0.0f;
+
+    if ( fcache != NULL ) {
+        if ( cached_storms < num_storms
+                && fread( &layer[cached.minL], sizeof(float), cached.maxL-cached.minL, fcache )
+                    != cached.maxL-cached.minL ) {
+            fprintf(stderr,"Error: Reading layer of cache entry in %s\n", cache_dir );
+            exit( EXIT_FAILURE );
+        }
+        fclose( fcache );
+    }
     
     /* 4. Storms simulation */
-    for( i=0; i<num_storms; i++) {
+    for( i=cached_storms; i<num_storms; i++) {
 
         /* 4.1. Add impacts energies to layer cells */
         /* For each particle */
@@ -303,8 +495,13 @@ int main(int argc, char *argv[]) {
 		printf("%d%s%f\n", positions[i], separator,  maximum[i]);
 	printf("\n");
 
+    /* 7.3. Store the results in the cache, unless they were all served from it */
+    if ( cache_dir != NULL && cached_storms < num_storms )
+        store_cache( cache_key[num_storms-1], cache_check[num_storms-1], layer, layer_size,
+                maximum, positions, num_storms );
+
     /* 8. Free resources */    
-    for( i=0; i<argc-2; i++ )
+    for( i=0; i<num_storms; i++ )
         free( storms[i].posval );
 
     free(layer);
@@ -21,6 +21,16 @@
 #include <sys/time.h>
 #include <omp.h>
 #include <assert.h>
+#include <string.h>
+#include <float.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #define DEFAULT_COLOR   "\033[0m"
 #define RED             "\033[0;31m"
@@ -72,6 +82,31 @@ double threshold = 0.001f;
 #undef ENERGY_RELAXATION_BEFORE
 #undef ENERGY_BOMBARDMENT_BEFORE
 
+/**
+ * Layers are allocated as anonymous mappings: the pages are zeroed by the
+ * operating system the first time they are touched, so only the range
+ * reached by the particles is ever written, and there is no initialization
+ * sweep over the whole layer.
+ */
+
+/*
+ * Function: Allocate a layer of num_cells cells initialized to zero
+ */
+energy_t *allocate_layer(int num_cells)
+{
+	void *cells = mmap(NULL, sizeof(energy_t) * (size_t) num_cells, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return cells == MAP_FAILED ? NULL : (energy_t *) cells;
+}
+
+/*
+ * Function: Release a layer allocated with allocate_layer
+ */
+void release_layer(energy_t *cells, int num_cells)
+{
+	munmap(cells, sizeof(energy_t) * (size_t) num_cells);
+}
+
 /* Structure used to store data for one storm of particles */
 typedef struct
 {
@@ -79,9 +114,8 @@ typedef struct
 	int *posval; // Positions and values
 } Storm;
 
-/* THIS FUNCTION CAN BE MODIFIED */
-/* Function to update a single position of the layer */
-void update(energy_t *layer, int layer_size, int k, int pos, energy_t energy)
+/* Function to compute the energy of a particle that reaches the k-th position of the layer */
+energy_t attenuated_energy(int layer_size, int k, int pos, energy_t energy)
 {
 	/* 1. Compute the absolute value of the distance between the
 	 impact position and the k-th position of the layer */
@@ -97,9 +131,15 @@ void update(energy_t *layer, int layer_size, int k, int pos, energy_t energy)
 	 We use here a tailored equation that affects a much wider range of cells */
 	float atenuacion = sqrtf((float) distance);
 	/* 4. Compute attenuated energy */
-	energy_t energy_k = energy / layer_size / atenuacion;
+	return energy / layer_size / atenuacion;
+}
+
+/* THIS FUNCTION CAN BE MODIFIED */
+/* Function to update a single position of the layer */
+void update(energy_t *layer, int layer_size, int k, int pos, energy_t energy)
+{
+	energy_t energy_k = attenuated_energy(layer_size, k, pos, energy);
 
-	
 	#ifndef ENERGY_BOMBARDMENT_BEFORE
 	/* 
 	 * Since the range where the absolute value is higher than the threshold
@@ -210,15 +250,224 @@ Storm read_storm_file(char *fname)
 	return storm;
 }
 
+/**
+ * Checkpoint files store the state of the simulation after the last storm:
+ * the header, the maximum and position of every storm simulated so far and
+ * the cells of the layer inside the active range [minL, maxL). The cells
+ * outside of that range were never touched, so they are always zero.
+ */
+#define CHECKPOINT_MAGIC "ESCK"
+#define CHECKPOINT_VERSION 2
+
+typedef struct
+{
+	char magic[4];
+	int version;
+	int layer_size;
+	int minL, maxL;
+	int num_storms;
+	double threshold;
+	unsigned long long key; // Check of the inputs of a result cache entry, 0 otherwise
+	int has_layer;          // The result cache entries can omit the layer
+} CheckpointHeader;
+
+/*
+ * Function: Check if a saved threshold is the one of this run. The default
+ * is the float 0.001f, a different double than -h 0.001, so the thresholds
+ * are compared as floats.
+ */
+boolean same_threshold(double saved)
+{
+	return (float) saved == (float) threshold;
+}
+
+/*
+ * Function: Write the layer active range and the per-storm maxima to an
+ * open file. Returns FALSE if the file could not be written
+ */
+boolean write_checkpoint(FILE *fcheck, energy_t *layer, int layer_size, int minL,
+		int maxL, energy_t *maximum, int *positions, int num_storms,
+		unsigned long long key, boolean has_layer)
+{
+	CheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	header.version = CHECKPOINT_VERSION;
+	header.layer_size = layer_size;
+	header.minL = minL;
+	header.maxL = maxL;
+	header.num_storms = num_storms;
+	header.threshold = threshold;
+	header.key = key;
+	header.has_layer = has_layer;
+
+	int interval = has_layer && maxL > minL ? maxL - minL : 0;
+
+	boolean written = fwrite(&header, sizeof(header), 1, fcheck) == 1
+			&& fwrite(maximum, sizeof(energy_t), num_storms, fcheck) == num_storms
+			&& fwrite(positions, sizeof(int), num_storms, fcheck) == num_storms
+			&& fwrite(&layer[minL], sizeof(energy_t), interval, fcheck) == interval;
+	return fclose(fcheck) == 0 && written;
+}
+
+/*
+ * Function: Save the layer active range and the per-storm maxima to a file
+ */
+void save_checkpoint(char *fname, energy_t *layer, int layer_size, int minL,
+		int maxL, energy_t *maximum, int *positions, int num_storms)
+{
+	FILE *fcheck = fopen(fname, "wb");
+	if (fcheck == NULL)
+	{
+		fprintf(stderr, "Error: Opening checkpoint file %s\n", fname);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!write_checkpoint(fcheck, layer, layer_size, minL, maxL, maximum,
+			positions, num_storms, 0, TRUE))
+	{
+		fprintf(stderr, "Error: Writing checkpoint file %s\n", fname);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Function: Open a checkpoint file and read its header. The returned file
+ * is positioned at the per-storm maxima, followed by the layer active range.
+ * Returns NULL if the file does not exist or is not a valid checkpoint.
+ */
+FILE *read_checkpoint_header(char *fname, CheckpointHeader *header)
+{
+	FILE *fcheck = fopen(fname, "rb");
+	if (fcheck == NULL)
+		return NULL;
+
+	if (fread(header, sizeof(*header), 1, fcheck) != 1
+			|| memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0
+			|| header->version != CHECKPOINT_VERSION || header->num_storms < 0
+			|| header->minL < 0 || header->maxL > header->layer_size)
+	{
+		fclose(fcheck);
+		return NULL;
+	}
+
+	return fcheck;
+}
+
+/*
+ * Function: Open a checkpoint file to resume from, exits on failure
+ */
+FILE *open_checkpoint(char *fname, CheckpointHeader *header)
+{
+	if (access(fname, R_OK) != 0)
+	{
+		fprintf(stderr, "Error: Opening checkpoint file %s\n", fname);
+		exit(EXIT_FAILURE);
+	}
+
+	FILE *fcheck = read_checkpoint_header(fname, header);
+	if (fcheck == NULL || !header->has_layer)
+	{
+		fprintf(stderr, "Error: Invalid checkpoint file %s\n", fname);
+		exit(EXIT_FAILURE);
+	}
+
+	return fcheck;
+}
+
+/*
+ * Function: Read the per-storm maxima stored in a checkpoint file
+ */
+void read_checkpoint_results(FILE *fcheck, char *fname,
+		CheckpointHeader *header, energy_t *maximum, int *positions)
+{
+	int num_storms = header->num_storms;
+	if (fread(maximum, sizeof(energy_t), num_storms, fcheck) != num_storms
+			|| fread(positions, sizeof(int), num_storms, fcheck) != num_storms)
+	{
+		fprintf(stderr, "Error: Reading results of checkpoint file %s\n", fname);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Function: Read the layer active range stored in a checkpoint file.
+ * The rest of the layer must be already initialized to zero.
+ */
+void read_checkpoint_layer(FILE *fcheck, char *fname,
+		CheckpointHeader *header, energy_t *layer)
+{
+	int interval = header->has_layer && header->maxL > header->minL ? header->maxL - header->minL : 0;
+	if (fread(&layer[header->minL], sizeof(energy_t), interval, fcheck) != interval)
+	{
+		fprintf(stderr, "Error: Reading layer of checkpoint file %s\n", fname);
+		exit(EXIT_FAILURE);
+	}
+}
+
 boolean csv = FALSE;
 
 short n_threads = 1;
 
+/**
+ * Checkpoint file to resume the simulation from (-r) and
+ * to save the simulation state to (-s)
+ */
+char *resume_file = NULL;
+char *checkpoint_file = NULL;
+
+/**
+ * Number of consecutive storms simulated per tile of the layer (-b).
+ * With 1 the storms are simulated one by one
+ */
+int temporal_block = 1;
+
+/**
+ * Number of threads that bombard the next storm while the others
+ * relax the current one (-p). With 0 the storms are not pipelined
+ */
+int pipeline_threads = 0;
+
+/**
+ * Relative error tolerance of the far-field approximation of the
+ * bombardment (-f), and check of the error against the exact
+ * bombardment (-v). With 0 the bombardment is exact
+ */
+double far_field_tolerance = 0.0;
+boolean far_field_check = FALSE;
+
+/**
+ * Number of highest local maxima reported for each storm (-k)
+ */
+int top_k = 0;
+
+/**
+ * Status file (-o) and UNIX socket (-u) where the progress of the
+ * simulation is reported
+ */
+char *progress_file = NULL;
+char *progress_socket = NULL;
+
+/**
+ * Prefix of the layer snapshot files (-x), written every snapshot_every
+ * storms (-e), with bins of snapshot_block cells or the raw layer if 0 (-z)
+ */
+char *snapshot_prefix = NULL;
+int snapshot_every = 1;
+int snapshot_block = 0;
+
+/**
+ * Directory of the result cache (-a), and storage of the layer in its
+ * entries to resume longer lists of storms from them (-l)
+ */
+char *cache_dir = NULL;
+boolean cache_layer = FALSE;
+
 short processOptions(int argc, char *argv[])
 {
 	short optargc = 0;
 	char c;
-	while ((c = getopt(argc, argv, "c:t:h:")) != -1)
+	while ((c = getopt(argc, argv, "c:t:h:r:s:b:p:f:vk:o:u:x:e:z:a:l")) != -1)
 	{
 		switch (c)
 		{
@@ -246,12 +495,241 @@ short processOptions(int argc, char *argv[])
 				optargc++;
 				break;
 			}
+			case 'r': case 'R':
+			{
+				resume_file = optarg;
+
+				optargc++;
+				break;
+			}
+			case 's': case 'S':
+			{
+				checkpoint_file = optarg;
+
+				optargc++;
+				break;
+			}
+			case 'b': case 'B':
+			{
+				temporal_block = atoi(optarg);
+
+				optargc++;
+				break;
+			}
+			case 'p': case 'P':
+			{
+				pipeline_threads = atoi(optarg);
+
+				optargc++;
+				break;
+			}
+			case 'f': case 'F':
+			{
+				far_field_tolerance = atof(optarg);
+
+				optargc++;
+				break;
+			}
+			case 'v': case 'V':
+			{
+				far_field_check = TRUE;
+				break;
+			}
+			case 'k': case 'K':
+			{
+				top_k = atoi(optarg);
+
+				optargc++;
+				break;
+			}
+			case 'o': case 'O':
+			{
+				progress_file = optarg;
+
+				optargc++;
+				break;
+			}
+			case 'u': case 'U':
+			{
+				progress_socket = optarg;
+
+				optargc++;
+				break;
+			}
+			case 'x': case 'X':
+			{
+				snapshot_prefix = optarg;
+
+				optargc++;
+				break;
+			}
+			case 'e': case 'E':
+			{
+				snapshot_every = atoi(optarg);
+
+				optargc++;
+				break;
+			}
+			case 'z': case 'Z':
+			{
+				snapshot_block = atoi(optarg);
+
+				optargc++;
+				break;
+			}
+			case 'a': case 'A':
+			{
+				cache_dir = optarg;
+
+				optargc++;
+				break;
+			}
+			case 'l': case 'L':
+			{
+				cache_layer = TRUE;
+				break;
+			}
 		}
 		optargc++;
 	}
 	return optargc;
 }
 
+/**
+ * Result cache (-a directory, -l to store the layer too).
+ *
+ * The entries are checkpoint files named after a hash of the inputs that
+ * determine the results: the program, the layer size, the threshold, the
+ * options that change the results, and the contents of the storms in
+ * order. The entry of a list of storms can serve a longer list that
+ * starts with the same storms, resuming from its layer. Any change of the
+ * inputs changes the hash, and a second hash of the same inputs, stored
+ * in the entry, is checked before using it.
+ */
+#define CACHE_KEY_SEED 0xcbf29ce484222325ULL
+#define CACHE_CHECK_SEED 0x84222325cbf29ce4ULL
+
+/* FNV-1a hash */
+unsigned long long hash_bytes(unsigned long long hash, const void *data, size_t bytes)
+{
+	const unsigned char *byte = (const unsigned char *) data;
+	for (size_t b = 0; b < bytes; b++)
+	{
+		hash ^= byte[b];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+unsigned long long hash_storm(unsigned long long hash, Storm *storm)
+{
+	hash = hash_bytes(hash, &storm->size, sizeof(storm->size));
+	return hash_bytes(hash, storm->posval, sizeof(int) * storm->size * 2);
+}
+
+/*
+ * Function: Compute the keys and checks of the cache entries of each prefix
+ * of the storms, from the layer size, the threshold and the options that
+ * change the results
+ */
+void cache_keys(int layer_size, Storm *storms, int num_storms,
+		unsigned long long *key, unsigned long long *check)
+{
+	char *program = "energy_storms_omp";
+	int version = CHECKPOINT_VERSION;
+	boolean pipelined = pipeline_threads > 0;
+	unsigned long long k = CACHE_KEY_SEED, c = CACHE_CHECK_SEED;
+
+	k = hash_bytes(k, program, strlen(program));
+	k = hash_bytes(k, &version, sizeof(version));
+	k = hash_bytes(k, &layer_size, sizeof(layer_size));
+	float key_threshold = (float) threshold;
+	k = hash_bytes(k, &key_threshold, sizeof(key_threshold));
+	k = hash_bytes(k, &far_field_tolerance, sizeof(far_field_tolerance));
+	k = hash_bytes(k, &pipelined, sizeof(pipelined));
+	c = hash_bytes(c, &k, sizeof(k));
+
+	for (int i = 0; i < num_storms; i++)
+	{
+		key[i] = k = hash_storm(k, &storms[i]);
+		check[i] = c = hash_storm(c, &storms[i]);
+	}
+}
+
+/* Name of the cache entry of a key, in a buffer of CACHE_NAME_LENGTH chars */
+#define CACHE_NAME_LENGTH (strlen(cache_dir) + 24)
+
+void cache_entry_name(char *name, unsigned long long key)
+{
+	sprintf(name, "%s/%016llx.esc", cache_dir, key);
+}
+
+/*
+ * Function: Find the entry of the longest cached prefix of the storms.
+ * Returns the number of cached storms, and the open entry in fcache
+ */
+int lookup_cache(int layer_size, int num_storms, unsigned long long *key,
+		unsigned long long *check, boolean need_layer, CheckpointHeader *header, FILE **fcache)
+{
+	char name[CACHE_NAME_LENGTH];
+	for (int i = num_storms - 1; i >= 0; i--)
+	{
+		cache_entry_name(name, key[i]);
+		*fcache = read_checkpoint_header(name, header);
+		if (*fcache == NULL)
+			continue;
+
+		/* A prefix can only be resumed from its layer */
+		if (header->key == check[i] && header->num_storms == i + 1
+				&& header->layer_size == layer_size && same_threshold(header->threshold)
+				&& (header->has_layer || (i == num_storms - 1 && !need_layer)))
+			return i + 1;
+
+		fclose(*fcache);
+	}
+	*fcache = NULL;
+	return 0;
+}
+
+/*
+ * Function: Store the results of the simulation in the cache. The results
+ * are already printed, so a failure is only reported
+ */
+void store_cache(unsigned long long key, unsigned long long check, energy_t *layer,
+		int layer_size, int minL, int maxL, energy_t *maximum, int *positions, int num_storms)
+{
+	/**
+	 * Written to a temporary file of this run and renamed, a reader never
+	 * sees a partial entry even if several runs store the same one
+	 */
+	char name[CACHE_NAME_LENGTH], tmp_name[CACHE_NAME_LENGTH + 8];
+	cache_entry_name(name, key);
+	sprintf(tmp_name, "%s.XXXXXX", name);
+
+	int fd = mkstemp(tmp_name);
+	FILE *fcache = fd < 0 ? NULL : fdopen(fd, "wb");
+	if (fcache == NULL)
+	{
+		if (fd >= 0)
+		{
+			close(fd);
+			unlink(tmp_name);
+		}
+		fprintf(stderr, "Warning: Creating cache entry %s\n", name);
+		return;
+	}
+
+	/* mkstemp only gives access to the owner */
+	fchmod(fd, 0644);
+
+	if (!write_checkpoint(fcache, layer, layer_size, minL, maxL, maximum, positions,
+			num_storms, check, cache_layer) || rename(tmp_name, name) != 0)
+	{
+		unlink(tmp_name);
+		fprintf(stderr, "Warning: Storing cache entry %s\n", name);
+	}
+}
+
 #ifndef ENERGY_RELAXATION_BEFORE
 void energy_relaxation(energy_t *layer, int layer_size)
 {
@@ -305,62 +783,1427 @@ void energy_relaxation(energy_t *layer, int layer_size)
 #endif
 
 /*
- * MAIN PROGRAM
+ * Function: Compute the range [minP, maxP) of the layer where the attenuated
+ * energy of a particle is not lower than the threshold
  */
-int main(int argc, char *argv[])
+void particle_range(int layer_size, int position, energy_t energy, int *minP, int *maxP)
 {
-	n_threads = omp_get_max_threads();
-
-	short optargc = processOptions(argc, argv);
+	long double atenuation = energy / threshold;
+	unsigned long long distanceMax = (unsigned long long) atenuation*atenuation;
 
-	if (n_threads <= 0)
-	{
-		fprintf(stderr, "Invalid number of threads! %d\n", n_threads);
-		exit(EXIT_FAILURE);
-	}
+	//check overflow
+	if(atenuation > 1.0 && distanceMax == 0)
+		distanceMax = layer_size;
 
-	if (threshold <= 0.0)
-	{
-		fprintf(stderr, "Invalid threshold! %f\n", threshold);
-		exit(EXIT_FAILURE);
-	}
+	//to avoid underflow, since distanceMax is an unsigned type
+	if(distanceMax > 0)
+		distanceMax--;
 
-	/* 1.1. Read arguments */
-	if (argc - optargc < 3)
-	{
-		fprintf(stderr,
-				"Usage: %s <options> <size> <storm_1_file> [ <storm_i_file> ] ... \n",
-				argv[0]);
-		exit(EXIT_FAILURE);
-	}
+	//to avoid overflows/undeflows
+	*maxP = distanceMax >= layer_size ? layer_size : position + distanceMax;
+	*minP = distanceMax >= position ? 0 : position - distanceMax;
 
-	int layer_size = atoi(argv[optargc + 1]);
-	int num_storms = argc - optargc - 2;
-	Storm storms[num_storms];
+	/**
+	 * maxP and minP can be out of bounds
+	 */
+	*maxP = *maxP >= layer_size ? layer_size : *maxP;
+	*minP = *minP >= layer_size ? layer_size : *minP;
+}
 
-	/* 1.2. Read storms information */
+/**
+ * Progress reporting (-o status file, -u UNIX socket).
+ *
+ * The storm loop only adds to atomic counters once per storm. A background
+ * thread rewrites the status file every PROGRESS_INTERVAL milliseconds, and
+ * sends a snapshot to every client that connects to the socket. SIGUSR1
+ * writes a snapshot to stderr (and to the status file) immediately.
+ */
+#define PROGRESS_INTERVAL 1000
+
+atomic_long progress_storms;
+atomic_long progress_particles;
+atomic_long progress_cells;
+int progress_total_storms;
+double progress_start;
+
+pthread_t progress_thread;
+int progress_pipe[2] = { -1, -1 };
+int progress_listen = -1;
+
+/*
+ * Function: Count a simulated storm, called once per storm by a single thread
+ */
+void progress_storm_done(long particles, long cells)
+{
+	if (progress_pipe[1] < 0)
+		return;
+
+	atomic_fetch_add_explicit(&progress_particles, particles, memory_order_relaxed);
+	atomic_fetch_add_explicit(&progress_cells, cells, memory_order_relaxed);
+	atomic_fetch_add_explicit(&progress_storms, 1, memory_order_release);
+}
+
+int format_progress(char *buffer, size_t size)
+{
+	long storms = atomic_load_explicit(&progress_storms, memory_order_acquire);
+	long particles = atomic_load_explicit(&progress_particles, memory_order_relaxed);
+	long cells = atomic_load_explicit(&progress_cells, memory_order_relaxed);
+	double elapsed = cp_Wtime() - progress_start;
+
+	double eta = storms > 0 ? elapsed * (progress_total_storms - storms) / storms : -1.0;
+
+	return snprintf(buffer, size,
+			"Storms: %ld/%d\nParticles/s: %f\nCells/s: %f\nElapsed: %f\nETA: %f\n",
+			storms, progress_total_storms, elapsed > 0 ? particles / elapsed : 0.0,
+			elapsed > 0 ? cells / elapsed : 0.0, elapsed, eta);
+}
+
+/* Rewrite the status file, through a temporary file so readers never see a partial one */
+void write_progress_file(char *snapshot, int length)
+{
+	char tmp_name[strlen(progress_file) + 5];
+	sprintf(tmp_name, "%s.tmp", progress_file);
+
+	FILE *fstatus = fopen(tmp_name, "w");
+	if (fstatus == NULL)
+		return;
+	fwrite(snapshot, 1, length, fstatus);
+	fclose(fstatus);
+	rename(tmp_name, progress_file);
+}
+
+/* Writes are best effort, the simulation must not stop because of a reader */
+void write_snapshot(int fd, char *snapshot, int length)
+{
+	ssize_t written = write(fd, snapshot, length);
+	(void) written;
+}
+
+void progress_signal_handler(int signum)
+{
+	write_snapshot(progress_pipe[1], "s", 1);
+	(void) signum;
+}
+
+void *progress_writer(void *arg)
+{
+	char snapshot[256];
+	boolean running = TRUE;
+
+	while (running)
+	{
+		struct pollfd fds[2] = { { progress_pipe[0], POLLIN, 0 }, { progress_listen, POLLIN, 0 } };
+		int ready = poll(fds, progress_listen >= 0 ? 2 : 1, PROGRESS_INTERVAL);
+		int length = format_progress(snapshot, sizeof(snapshot));
+
+		if (ready > 0 && (fds[0].revents & POLLIN))
+		{
+			char c;
+			if (read(progress_pipe[0], &c, 1) == 1)
+			{
+				if (c == 'q')
+					running = FALSE;
+				else
+					write_snapshot(STDERR_FILENO, snapshot, length);
+			}
+		}
+
+		if (ready > 0 && progress_listen >= 0 && (fds[1].revents & POLLIN))
+		{
+			int client = accept(progress_listen, NULL, NULL);
+			if (client >= 0)
+			{
+				write_snapshot(client, snapshot, length);
+				close(client);
+			}
+		}
+
+		if (progress_file != NULL)
+			write_progress_file(snapshot, length);
+	}
+	(void) arg;
+	return NULL;
+}
+
+/*
+ * Function: Start the progress reporting thread, if a status file or a socket was given
+ */
+void start_progress(int total_storms)
+{
+	if (progress_file == NULL && progress_socket == NULL)
+		return;
+
+	atomic_init(&progress_storms, 0);
+	atomic_init(&progress_particles, 0);
+	atomic_init(&progress_cells, 0);
+	progress_total_storms = total_storms;
+	progress_start = cp_Wtime();
+
+	if (progress_socket != NULL)
+	{
+		struct sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		strncpy(address.sun_path, progress_socket, sizeof(address.sun_path) - 1);
+		unlink(progress_socket);
+
+		progress_listen = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (progress_listen < 0
+				|| bind(progress_listen, (struct sockaddr *) &address, sizeof(address)) != 0
+				|| listen(progress_listen, 8) != 0)
+		{
+			fprintf(stderr, "Error: Opening progress socket %s\n", progress_socket);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (pipe(progress_pipe) != 0)
+	{
+		fprintf(stderr, "Error: Creating the progress pipe\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = progress_signal_handler;
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &action, NULL);
+
+	if (pthread_create(&progress_thread, NULL, progress_writer, NULL) != 0)
+	{
+		fprintf(stderr, "Error: Creating the progress thread\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Function: Stop the progress reporting thread, after a last update of the status file
+ */
+void stop_progress()
+{
+	if (progress_pipe[1] < 0)
+		return;
+
+	write_snapshot(progress_pipe[1], "q", 1);
+	pthread_join(progress_thread, NULL);
+
+	signal(SIGUSR1, SIG_IGN);
+	close(progress_pipe[0]);
+	close(progress_pipe[1]);
+	progress_pipe[0] = progress_pipe[1] = -1;
+
+	if (progress_listen >= 0)
+	{
+		close(progress_listen);
+		unlink(progress_socket);
+	}
+}
+
+/**
+ * Layer snapshots (-x prefix, -e every, -z block).
+ *
+ * After the selected storms the team copies the active range of the layer
+ * to one of two snapshot buffers, and a background thread writes it to
+ * <prefix>_<storm>.bin while the simulation goes on. The simulation only
+ * waits when both buffers are still being written.
+ *
+ * The file starts with a SnapshotHeader. With block 0 it is followed by the
+ * layer_size cells of the layer. Otherwise it is a pyramid of levels: the
+ * first one has bins of block cells, and each next one merges two bins of
+ * the previous one, up to a single bin. Each level is the number of bins
+ * and the cells per bin (two ints), then the minimum, maximum and mean
+ * values of all the bins (three arrays of floats). The last bin of a level
+ * can have fewer cells.
+ */
+#define SNAPSHOT_MAGIC "ESSN"
+#define SNAPSHOT_VERSION 1
+
+typedef struct
+{
+	char magic[4];
+	int version;
+	int storm;
+	int layer_size;
+	int minL, maxL;
+	int block;
+	int levels;
+} SnapshotHeader;
+
+typedef struct
+{
+	energy_t *cells;  // Layer copy, zero outside [minL, maxL)
+	int storm;
+	int minL, maxL;
+	boolean full;
+} SnapshotBuffer;
+
+SnapshotBuffer snapshot_buffers[2];
+int snapshot_fill = 0, snapshot_write = 0;
+boolean snapshot_done = FALSE;
+int snapshot_layer_size;
+pthread_t snapshot_thread;
+pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t snapshot_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Function: Write a snapshot buffer to its file
+ */
+void write_snapshot_file(SnapshotBuffer *buffer)
+{
+	char fname[strlen(snapshot_prefix) + 16];
+	sprintf(fname, "%s_%d.bin", snapshot_prefix, buffer->storm);
+
+	FILE *fsnap = fopen(fname, "wb");
+	if (fsnap == NULL)
+	{
+		fprintf(stderr, "Error: Opening snapshot file %s\n", fname);
+		exit(EXIT_FAILURE);
+	}
+
+	int layer_size = snapshot_layer_size;
+	SnapshotHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.storm = buffer->storm;
+	header.layer_size = layer_size;
+	header.minL = buffer->minL;
+	header.maxL = buffer->maxL;
+	header.block = snapshot_block;
+
+	int ok = 1;
+	if (snapshot_block == 0)
+	{
+		header.levels = 0;
+		ok = fwrite(&header, sizeof(header), 1, fsnap) == 1
+				&& fwrite(buffer->cells, sizeof(energy_t), layer_size, fsnap) == layer_size;
+	}
+	else
+	{
+		int bins = (layer_size + snapshot_block - 1) / snapshot_block;
+		header.levels = 1;
+		for (int b = bins; b > 1; b = (b + 1) / 2)
+			header.levels++;
+
+		energy_t *minimum = (energy_t *) malloc(sizeof(energy_t) * bins);
+		energy_t *maximum = (energy_t *) malloc(sizeof(energy_t) * bins);
+		energy_t *mean = (energy_t *) malloc(sizeof(energy_t) * bins);
+		double *sum = (double *) malloc(sizeof(double) * bins);
+		if (minimum == NULL || maximum == NULL || mean == NULL || sum == NULL)
+		{
+			fprintf(stderr, "Error: Allocating the snapshot pyramid memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		/* First level, from the cells */
+		for (int b = 0; b < bins; b++)
+		{
+			int first = b * snapshot_block;
+			int end = first + snapshot_block < layer_size ? first + snapshot_block : layer_size;
+			minimum[b] = maximum[b] = buffer->cells[first];
+			sum[b] = 0.0;
+			for (int k = first; k < end; k++)
+			{
+				minimum[b] = buffer->cells[k] < minimum[b] ? buffer->cells[k] : minimum[b];
+				maximum[b] = buffer->cells[k] > maximum[b] ? buffer->cells[k] : maximum[b];
+				sum[b] += buffer->cells[k];
+			}
+		}
+
+		ok = fwrite(&header, sizeof(header), 1, fsnap) == 1;
+		for (int level = 0, binSize = snapshot_block; ok && level < header.levels; level++)
+		{
+			for (int b = 0; b < bins; b++)
+			{
+				int cells = b < bins - 1 ? binSize : layer_size - b * binSize;
+				mean[b] = sum[b] / cells;
+			}
+
+			ok = fwrite(&bins, sizeof(int), 1, fsnap) == 1
+					&& fwrite(&binSize, sizeof(int), 1, fsnap) == 1
+					&& fwrite(minimum, sizeof(energy_t), bins, fsnap) == bins
+					&& fwrite(maximum, sizeof(energy_t), bins, fsnap) == bins
+					&& fwrite(mean, sizeof(energy_t), bins, fsnap) == bins;
+
+			/* Next level, merging pairs of bins */
+			for (int b = 0; 2 * b < bins; b++)
+			{
+				int pair = 2 * b + 1 < bins ? 2 * b + 1 : 2 * b;
+				minimum[b] = minimum[2 * b] < minimum[pair] ? minimum[2 * b] : minimum[pair];
+				maximum[b] = maximum[2 * b] > maximum[pair] ? maximum[2 * b] : maximum[pair];
+				sum[b] = pair != 2 * b ? sum[2 * b] + sum[pair] : sum[2 * b];
+			}
+			bins = (bins + 1) / 2;
+			binSize *= 2;
+		}
+
+		free(minimum);
+		free(maximum);
+		free(mean);
+		free(sum);
+	}
+
+	if (!ok || fclose(fsnap) != 0)
+	{
+		fprintf(stderr, "Error: Writing snapshot file %s\n", fname);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void *snapshot_writer(void *arg)
+{
+	pthread_mutex_lock(&snapshot_mutex);
+	for (;;)
+	{
+		SnapshotBuffer *buffer = &snapshot_buffers[snapshot_write];
+		while (!buffer->full && !snapshot_done)
+			pthread_cond_wait(&snapshot_cond, &snapshot_mutex);
+		if (!buffer->full)
+			break;
+		pthread_mutex_unlock(&snapshot_mutex);
+
+		write_snapshot_file(buffer);
+
+		pthread_mutex_lock(&snapshot_mutex);
+		buffer->full = FALSE;
+		snapshot_write = 1 - snapshot_write;
+		pthread_cond_broadcast(&snapshot_cond);
+	}
+	pthread_mutex_unlock(&snapshot_mutex);
+	(void) arg;
+	return NULL;
+}
+
+/*
+ * Function: Start the snapshot writer thread, if a snapshot prefix was given
+ */
+void start_snapshots(int layer_size)
+{
+	if (snapshot_prefix == NULL)
+		return;
+
+	snapshot_layer_size = layer_size;
+	for (int b = 0; b < 2; b++)
+	{
+		snapshot_buffers[b].cells = allocate_layer(layer_size + 1);
+		snapshot_buffers[b].full = FALSE;
+		if (snapshot_buffers[b].cells == NULL)
+		{
+			fprintf(stderr, "Error: Allocating the snapshot memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (pthread_create(&snapshot_thread, NULL, snapshot_writer, NULL) != 0)
+	{
+		fprintf(stderr, "Error: Creating the snapshot thread\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Function: Wait for the snapshots being written and stop the writer thread
+ */
+void stop_snapshots()
+{
+	if (snapshot_prefix == NULL)
+		return;
+
+	pthread_mutex_lock(&snapshot_mutex);
+	snapshot_done = TRUE;
+	pthread_cond_broadcast(&snapshot_cond);
+	pthread_mutex_unlock(&snapshot_mutex);
+	pthread_join(snapshot_thread, NULL);
+
+	for (int b = 0; b < 2; b++)
+		release_layer(snapshot_buffers[b].cells, snapshot_layer_size + 1);
+}
+
+/* The selected storms are every snapshot_every storms, and the last one */
+boolean snapshot_selected(int storm, int total_storms)
+{
+	return snapshot_prefix != NULL && ((storm + 1) % snapshot_every == 0 || storm == total_storms - 1);
+}
+
+/*
+ * Function: Get the next free snapshot buffer, waiting for the writer if needed
+ */
+SnapshotBuffer *acquire_snapshot_buffer()
+{
+	pthread_mutex_lock(&snapshot_mutex);
+	SnapshotBuffer *buffer = &snapshot_buffers[snapshot_fill];
+	while (buffer->full)
+		pthread_cond_wait(&snapshot_cond, &snapshot_mutex);
+	pthread_mutex_unlock(&snapshot_mutex);
+	return buffer;
+}
+
+/*
+ * Function: Hand a filled snapshot buffer to the writer
+ */
+void submit_snapshot_buffer(SnapshotBuffer *buffer, int storm, int minL, int maxL)
+{
+	pthread_mutex_lock(&snapshot_mutex);
+	buffer->storm = storm;
+	buffer->minL = minL;
+	buffer->maxL = maxL;
+	buffer->full = TRUE;
+	snapshot_fill = 1 - snapshot_fill;
+	pthread_cond_broadcast(&snapshot_cond);
+	pthread_mutex_unlock(&snapshot_mutex);
+}
+
+/* Local maximum of the layer, for the report of the K highest ones (-k) */
+typedef struct
+{
+	int position;
+	energy_t value;
+} LocalMaximum;
+
+/**
+ * Order of the local maxima: the highest value first and, with the same
+ * value, the lowest position first. It does not depend on how the layer
+ * is split among the threads
+ */
+boolean local_maximum_before(LocalMaximum *a, LocalMaximum *b)
+{
+	return a->value > b->value || (a->value == b->value && a->position < b->position);
+}
+
+int compare_local_maxima(const void *a, const void *b)
+{
+	if (local_maximum_before((LocalMaximum *) a, (LocalMaximum *) b))
+		return -1;
+	return local_maximum_before((LocalMaximum *) b, (LocalMaximum *) a) ? 1 : 0;
+}
+
+/*
+ * Function: Insert a local maximum in a heap that keeps the capacity highest
+ * ones. The root of the heap is the lowest of them.
+ */
+void push_local_maximum(LocalMaximum *heap, int *size, int capacity,
+		int position, energy_t value)
+{
+	LocalMaximum item = { position, value };
+	int i;
+
+	if (*size < capacity)
+	{
+		/* Sift up from the new leaf */
+		i = (*size)++;
+		while (i > 0 && local_maximum_before(&heap[(i - 1) / 2], &item))
+		{
+			heap[i] = heap[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+		heap[i] = item;
+		return;
+	}
+
+	if (capacity == 0 || !local_maximum_before(&item, &heap[0]))
+		return;
+
+	/* Replace the root and sift down */
+	i = 0;
+	for (;;)
+	{
+		int child = 2 * i + 1;
+		if (child >= *size)
+			break;
+		if (child + 1 < *size && local_maximum_before(&heap[child], &heap[child + 1]))
+			child++;
+		if (!local_maximum_before(&item, &heap[child]))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = item;
+}
+
+/*
+ * Function: Insert the local maxima of a heap into another one
+ */
+void merge_local_maxima(LocalMaximum *heap, int *size, int capacity,
+		LocalMaximum *other, int other_size)
+{
+	for (int m = 0; m < other_size; m++)
+		push_local_maximum(heap, size, capacity, other[m].position, other[m].value);
+}
+
+/*
+ * Function: Allocate heaps of local maxima for a range of cells. A range
+ * has less local maxima than cells, so the capacity is at most its length.
+ * Returns NULL when no local maxima are reported.
+ */
+LocalMaximum *allocate_local_maxima(int heaps, int cells, int *capacity)
+{
+	*capacity = top_k < cells ? top_k : cells;
+	if (*capacity <= 0)
+	{
+		*capacity = 0;
+		return NULL;
+	}
+
+	LocalMaximum *heap = (LocalMaximum *) malloc(sizeof(LocalMaximum) * (size_t) heaps * *capacity);
+	if (heap == NULL)
+	{
+		fprintf(stderr, "Error: Allocating the local maxima memory\n");
+		exit(EXIT_FAILURE);
+	}
+	return heap;
+}
+
+#if !defined(ENERGY_RELAXATION_BEFORE) && !defined(ENERGY_BOMBARDMENT_BEFORE)
+/**
+ * Number of cells of the layer owned by a tile of the temporally blocked engine.
+ * A tile, with its halo, should fit in the private cache of a core.
+ */
+#define TEMPORAL_TILE_SIZE 16384
+
+/* Impact of a particle, with the range of the layer it affects */
+typedef struct
+{
+	int position;
+	energy_t energy;
+	int minP, maxP;
+} Impact;
+
+/*
+ * Function: Compute the impacts of the particles of consecutive storms.
+ * The impacts of the t-th storm are [impactsStart[t], impactsStart[t + 1]),
+ * and the active range of the layer after it is [stormMinL[t], stormMaxL[t]).
+ */
+Impact *compute_impacts(int layer_size, Storm *storms, int num_storms,
+		int *impactsStart, int *stormMinL, int *stormMaxL, int *minL, int *maxL)
+{
+	int num_impacts = 0;
+	for (int t = 0; t < num_storms; t++)
+		num_impacts += storms[t].size;
+
+	Impact *impacts = (Impact *) malloc(sizeof(Impact) * (num_impacts + 1));
+	if (impacts == NULL)
+	{
+		fprintf(stderr, "Error: Allocating the impacts memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	int n = 0;
+	for (int t = 0; t < num_storms; t++)
+	{
+		impactsStart[t] = n;
+		for (int j = 0; j < storms[t].size; j++, n++)
+		{
+			/* Get impact energy (expressed in thousandths) */
+			impacts[n].energy = (energy_t) storms[t].posval[j * 2 + 1] * 1000;
+			/* Get impact position */
+			impacts[n].position = storms[t].posval[j * 2];
+
+			particle_range(layer_size, impacts[n].position, impacts[n].energy,
+					&impacts[n].minP, &impacts[n].maxP);
+
+			*maxL = impacts[n].maxP > *maxL ? impacts[n].maxP : *maxL;
+			*minL = impacts[n].minP < *minL ? impacts[n].minP : *minL;
+		}
+		stormMinL[t] = *minL;
+		stormMaxL[t] = *maxL;
+	}
+	impactsStart[num_storms] = n;
+
+	return impacts;
+}
+
+/*
+ * Function: Number of cells reached by the impacts [first, last)
+ */
+long impacts_cells(Impact *impacts, int first, int last)
+{
+	long cells = 0;
+	for (int p = first; p < last; p++)
+		cells += impacts[p].maxP - impacts[p].minP;
+	return cells;
+}
+
+/*
+ * Function: Choose the maximum of a storm as the storm by storm simulation does.
+ * peak is the highest local maximum inside the active range [minL, maxL), and
+ * lowValue and highValue are the values of the cells minL and maxL.
+ */
+void choose_maximum(energy_t peak, energy_t lowValue, energy_t highValue,
+		int minL, int maxL, energy_t *maximum, int *position)
+{
+	boolean found = peak > lowValue;
+	int maxk = found && highValue > lowValue ? maxL : minL;
+	energy_t value = maxk == maxL ? highValue : lowValue;
+
+	if (value > *maximum)
+	{
+		*maximum = value;
+		*position = maxk;
+	}
+}
+
+/*
+ * Function: Simulate the storms with temporal blocking.
+ *
+ * The storms are processed in blocks of block_size consecutive storms.
+ * The active range of the layer is split in tiles and each thread copies
+ * a tile, plus a halo of block_size + 1 cells on each side, to a private
+ * buffer, where it applies the bombardment, the relaxation and the local
+ * maximum search of every storm of the block. Each step invalidates one
+ * more cell at each end of the buffer, so the owned cells of the tile are
+ * still exact after the whole block, and are written to layer_next.
+ * The layer is streamed through the cache once per block, instead of three
+ * times per storm, and the results are the same as the ones of the
+ * storm by storm simulation.
+ *
+ * Both layers must have layer_size + 1 cells, zero outside [minL, maxL).
+ */
+void simulate_storms_blocked(energy_t *layer, energy_t *layer_next,
+		int layer_size, Storm *storms, int num_storms, int block_size,
+		int *minL, int *maxL, energy_t *maximum, int *positions,
+		LocalMaximum *top_maxima, int *top_sizes)
+{
+	energy_t *layer_first = layer;
+
+	for (int first = 0; first < num_storms; first += block_size)
+	{
+		int steps = num_storms - first < block_size ? num_storms - first : block_size;
+
+		/* 1. Compute the range affected by each particle of the block */
+		int impactsStart[steps + 1];
+		int stormMinL[steps], stormMaxL[steps];
+		Impact *impacts = compute_impacts(layer_size, &storms[first], steps,
+				impactsStart, stormMinL, stormMaxL, minL, maxL);
+
+		/**
+		 * Values of the cells minL and maxL after each storm, and the highest
+		 * local maximum. The cells out of the tiles are not changed by the block.
+		 */
+		energy_t lowValue[steps], highValue[steps], peak[steps];
+		for (int t = 0; t < steps; t++)
+		{
+			lowValue[t] = layer[stormMinL[t]];
+			highValue[t] = layer[stormMaxL[t]];
+			peak[t] = -INFINITY;
+		}
+
+		int begin = *minL, end = *maxL;
+		int halo = steps + 1;
+
+		/* 2. Simulate the block of storms tile by tile */
+		#pragma omp parallel num_threads(n_threads) if(n_threads > 1 && end - begin > MIN_PARALLEL_THRESHOLD)
+		{
+			energy_t *buffer = (energy_t *) malloc(sizeof(energy_t) * (TEMPORAL_TILE_SIZE + 2 * halo));
+			if (buffer == NULL)
+			{
+				fprintf(stderr, "Error: Allocating the tile memory\n");
+				exit(EXIT_FAILURE);
+			}
+
+			energy_t threadPeak[steps];
+			for (int t = 0; t < steps; t++)
+				threadPeak[t] = -INFINITY;
+
+			int topCapacity;
+			LocalMaximum *threadTop = allocate_local_maxima(steps, end - begin, &topCapacity);
+			int threadTopSize[steps];
+			for (int t = 0; t < steps; t++)
+				threadTopSize[t] = 0;
+
+			#pragma omp for schedule(static)
+			for (int a = begin; a < end; a += TEMPORAL_TILE_SIZE)
+			{
+				int b = a + TEMPORAL_TILE_SIZE < end ? a + TEMPORAL_TILE_SIZE : end;
+				int ea = a - halo > 0 ? a - halo : 0;
+				int eb = b + halo < layer_size ? b + halo : layer_size;
+
+				/* Cell k of the layer is tile[k] */
+				energy_t *tile = buffer - ea;
+				memcpy(buffer, &layer[ea], sizeof(energy_t) * (eb - ea));
+
+				for (int t = 0; t < steps; t++)
+				{
+					/* 2.1. Add impacts energies to the cells of the buffer */
+					for (int p = impactsStart[t]; p < impactsStart[t + 1]; p++)
+					{
+						int lo = impacts[p].minP > ea ? impacts[p].minP : ea;
+						int hi = impacts[p].maxP < eb ? impacts[p].maxP : eb;
+						for (int k = lo; k < hi; k++)
+							tile[k] = tile[k] + attenuated_energy(layer_size, k,
+									impacts[p].position, impacts[p].energy);
+					}
+
+					/* 2.2. Energy relaxation, the first and last cells of the active range are kept */
+					int lo = stormMinL[t] + 1 > ea + 1 ? stormMinL[t] + 1 : ea + 1;
+					int hi = stormMaxL[t] - 1 < eb - 1 ? stormMaxL[t] - 1 : eb - 1;
+					if (lo < hi)
+					{
+						energy_t oldPreviousCellValue = tile[lo - 1];
+						for (int k = lo; k < hi; k++)
+						{
+							energy_t oldCurrentCellValue = tile[k];
+							tile[k] = (oldPreviousCellValue + tile[k] + tile[k + 1]) / 3;
+							oldPreviousCellValue = oldCurrentCellValue;
+						}
+					}
+
+					/* 2.3. Locate the highest local maximum of the owned cells */
+					lo = stormMinL[t] + 1 > a ? stormMinL[t] + 1 : a;
+					hi = stormMaxL[t] - 1 < b ? stormMaxL[t] - 1 : b;
+					for (int k = lo; k < hi; k++)
+					{
+						if (tile[k] > tile[k - 1] && tile[k] > tile[k + 1])
+						{
+							if (tile[k] > threadPeak[t])
+								threadPeak[t] = tile[k];
+							if (top_k > 0)
+								push_local_maximum(&threadTop[t * topCapacity], &threadTopSize[t],
+										topCapacity, k, tile[k]);
+						}
+					}
+
+					if (stormMinL[t] >= a && stormMinL[t] < b)
+						lowValue[t] = tile[stormMinL[t]];
+					if (stormMaxL[t] >= a && stormMaxL[t] < b)
+						highValue[t] = tile[stormMaxL[t]];
+				}
+
+				memcpy(&layer_next[a], &tile[a], sizeof(energy_t) * (b - a));
+			}
+
+			#pragma omp critical
+			{
+				for (int t = 0; t < steps; t++)
+				{
+					if (threadPeak[t] > peak[t])
+						peak[t] = threadPeak[t];
+					merge_local_maxima(&top_maxima[(size_t) (first + t) * top_k], &top_sizes[first + t],
+							top_k, &threadTop[t * topCapacity], threadTopSize[t]);
+				}
+			}
+
+			free(buffer);
+			free(threadTop);
+		}
+
+		/* 3. Same choice of the maximum as in the storm by storm simulation */
+		for (int t = 0; t < steps; t++)
+		{
+			choose_maximum(peak[t], lowValue[t], highValue[t], stormMinL[t],
+					stormMaxL[t], &maximum[first + t], &positions[first + t]);
+
+			progress_storm_done(storms[first + t].size,
+					impacts_cells(impacts, impactsStart[t], impactsStart[t + 1]));
+
+			free(storms[first + t].posval);
+		}
+		free(impacts);
+
+		energy_t *swap = layer;
+		layer = layer_next;
+		layer_next = swap;
+	}
+
+	if (layer != layer_first && *maxL > *minL)
+		memcpy(&layer_first[*minL], &layer[*minL], sizeof(energy_t) * (*maxL - *minL));
+}
+
+/*
+ * Function: Value of the k-th cell after adding the bombardment delta and relaxing
+ * the active range [minL, maxL), computed from the layer before the storm
+ */
+energy_t relaxed_value(energy_t *layer, energy_t *delta, int k, int minL, int maxL)
+{
+	if (k > minL && k < maxL - 1)
+		return ((layer[k - 1] + delta[k - 1]) + (layer[k] + delta[k])
+				+ (layer[k + 1] + delta[k + 1])) / 3;
+	else
+		return layer[k] + delta[k];
+}
+
+/*
+ * Function: Simulate the storms with a pipeline between consecutive storms.
+ *
+ * The bombardment of a storm does not depend on the layer, so it is
+ * accumulated in a delta buffer by bombard_threads threads while the
+ * rest of the team relaxes the layer and locates the maximum of the
+ * previous storm. The relaxation adds the delta to the cells it reads and
+ * writes the result to layer_next, so no barrier is needed between the
+ * threads that relax. The threads that bombard clear the delta buffer
+ * they will fill, which was consumed two storms before.
+ *
+ * The results can differ in the last digits from the storm by storm
+ * simulation when the storms have more than one particle, because the
+ * energies of a storm are added together before being added to the layer.
+ *
+ * The layers and both deltas must have layer_size + 1 cells, the
+ * deltas must be zero and the layers zero outside [minL, maxL).
+ */
+void simulate_storms_pipelined(energy_t *layer, energy_t *layer_next,
+		energy_t *delta_even, energy_t *delta_odd, int layer_size, Storm *storms,
+		int num_storms, int bombard_threads, int *minL, int *maxL,
+		energy_t *maximum, int *positions, LocalMaximum *top_maxima, int *top_sizes)
+{
+	energy_t *layer_first = layer;
+
+	int impactsStart[num_storms + 1];
+	int stormMinL[num_storms], stormMaxL[num_storms];
+	Impact *impacts = compute_impacts(layer_size, storms, num_storms,
+			impactsStart, stormMinL, stormMaxL, minL, maxL);
+
+	energy_t peak;
+
+	#pragma omp parallel num_threads(n_threads)
+	{
+		int nth = omp_get_num_threads(), tid = omp_get_thread_num();
+
+		/* A team of one thread does both stages, one after the other */
+		int bombarders = nth == 1 ? 1 : (bombard_threads < nth ? bombard_threads : nth - 1);
+		int relaxers = nth == 1 ? 1 : nth - bombarders;
+		boolean relaxes = tid < relaxers;
+		boolean bombards = nth == 1 || tid >= relaxers;
+		int bombarder = nth == 1 ? 0 : tid - relaxers;
+
+		/* Stage s bombards the storm s and relaxes the storm s - 1 */
+		for (int s = 0; s <= num_storms; s++)
+		{
+			energy_t *delta = s % 2 == 0 ? delta_even : delta_odd;
+			energy_t *delta_prev = s % 2 == 0 ? delta_odd : delta_even;
+
+			#pragma omp single
+			peak = -INFINITY;
+
+			/* 1. Add impacts energies of the storm s to its delta buffer */
+			if (bombards && s < num_storms && stormMaxL[s] > stormMinL[s])
+			{
+				int interval = stormMaxL[s] - stormMinL[s];
+				int first = stormMinL[s] + (int) ((long long) interval * bombarder / bombarders);
+				int end = stormMinL[s] + (int) ((long long) interval * (bombarder + 1) / bombarders);
+
+				for (int k = first; k < end; k++)
+					delta[k] = 0.0f;
+
+				for (int p = impactsStart[s]; p < impactsStart[s + 1]; p++)
+				{
+					int lo = impacts[p].minP > first ? impacts[p].minP : first;
+					int hi = impacts[p].maxP < end ? impacts[p].maxP : end;
+					for (int k = lo; k < hi; k++)
+						delta[k] = delta[k] + attenuated_energy(layer_size, k,
+								impacts[p].position, impacts[p].energy);
+				}
+			}
+
+			/* 2. Relax the layer after the storm s - 1 and locate its highest local maximum */
+			if (relaxes && s > 0 && stormMaxL[s - 1] > stormMinL[s - 1])
+			{
+				int lowL = stormMinL[s - 1], highL = stormMaxL[s - 1];
+				int interval = highL - lowL;
+				int first = lowL + (int) ((long long) interval * tid / relaxers);
+				int end = lowL + (int) ((long long) interval * (tid + 1) / relaxers);
+
+				for (int k = first; k < end; k++)
+					layer_next[k] = relaxed_value(layer, delta_prev, k, lowL, highL);
+
+				/* The neighbours out of [first, end) are computed again, not read */
+				energy_t threadPeak = -INFINITY;
+				int topCapacity;
+				LocalMaximum *threadTop = allocate_local_maxima(1, end - first, &topCapacity);
+				int threadTopSize = 0;
+				int lo = lowL + 1 > first ? lowL + 1 : first;
+				int hi = highL - 1 < end ? highL - 1 : end;
+				for (int k = lo; k < hi; k++)
+				{
+					energy_t left = k == first ? relaxed_value(layer, delta_prev, k - 1, lowL, highL) : layer_next[k - 1];
+					energy_t right = k == end - 1 ? relaxed_value(layer, delta_prev, k + 1, lowL, highL) : layer_next[k + 1];
+					if (layer_next[k] > left && layer_next[k] > right)
+					{
+						if (layer_next[k] > threadPeak)
+							threadPeak = layer_next[k];
+						if (top_k > 0)
+							push_local_maximum(threadTop, &threadTopSize, topCapacity, k, layer_next[k]);
+					}
+				}
+
+				#pragma omp critical
+				{
+					if (threadPeak > peak)
+						peak = threadPeak;
+					merge_local_maxima(&top_maxima[(size_t) (s - 1) * top_k], &top_sizes[s - 1],
+							top_k, threadTop, threadTopSize);
+				}
+				free(threadTop);
+			}
+
+			#pragma omp barrier
+
+			#pragma omp single
+			{
+				if (s > 0)
+				{
+					int t = s - 1;
+					choose_maximum(peak, layer_next[stormMinL[t]], layer_next[stormMaxL[t]],
+							stormMinL[t], stormMaxL[t], &maximum[t], &positions[t]);
+
+					progress_storm_done(storms[t].size,
+							impacts_cells(impacts, impactsStart[t], impactsStart[t + 1]));
+
+					free(storms[t].posval);
+
+					energy_t *swap = layer;
+					layer = layer_next;
+					layer_next = swap;
+				}
+			}
+		}
+	}
+
+	free(impacts);
+
+	if (layer != layer_first && *maxL > *minL)
+		memcpy(&layer_first[*minL], &layer[*minL], sizeof(energy_t) * (*maxL - *minL));
+}
+#endif
+
+#if !defined(ENERGY_RELAXATION_BEFORE) && !defined(ENERGY_BOMBARDMENT_BEFORE)
+/**
+ * Far-field approximation of the bombardment.
+ *
+ * The particles of a storm are sorted by position and grouped in a binary
+ * tree of clusters. The energy that reaches a cell from a cluster far away
+ * from it is approximated with a Taylor expansion of order FAR_FIELD_ORDER
+ * of 1/sqrt(distance+1) around the center of the cluster, computed from the
+ * moments of the energies of its particles. The near clusters are added
+ * exactly, particle by particle. A cluster is only approximated for the
+ * cells that are inside the range of all of its particles, so the threshold
+ * cut of the exact bombardment is kept.
+ *
+ * The remainder of the expansion bounds the error of the energy added to
+ * a cell by tolerance * (sum of the absolute energies that reach it).
+ */
+#define FAR_FIELD_ORDER 4
+#define FAR_FIELD_LEAF_SIZE 16
+#define FAR_FIELD_TILE_SIZE 256
+
+/* Cluster of the particles [first, last) of the sorted impacts */
+typedef struct
+{
+	int first, last;
+	int left, right;          // Children, -1 on the leaves
+	double center, halfWidth; // Of the positions of the particles
+	int minAll, maxAll;       // Cells reached by all the particles
+	int minAny, maxAny;       // Cells reached by any particle
+	double moments[FAR_FIELD_ORDER + 1];
+} Cluster;
+
+typedef struct
+{
+	Impact *impacts;
+	Cluster *clusters;
+	int num_clusters;
+	double theta;             // Maximum halfWidth / (distance - halfWidth + 1)
+} FarField;
+
+double far_field_max_error = 0.0;
+long far_field_violations = 0;
+
+int compare_impacts(const void *a, const void *b)
+{
+	return ((Impact *) a)->position - ((Impact *) b)->position;
+}
+
+/*
+ * Function: Build the clusters of the impacts [first, last), returns the root
+ */
+int build_cluster(FarField *farField, int first, int last)
+{
+	int c = farField->num_clusters++;
+	Cluster *cluster = &farField->clusters[c];
+	Impact *impacts = farField->impacts;
+
+	cluster->first = first;
+	cluster->last = last;
+	cluster->center = (impacts[first].position + impacts[last - 1].position) / 2.0;
+	cluster->halfWidth = (impacts[last - 1].position - impacts[first].position) / 2.0;
+	cluster->minAll = cluster->minAny = impacts[first].minP;
+	cluster->maxAll = cluster->maxAny = impacts[first].maxP;
+
+	for (int n = 0; n <= FAR_FIELD_ORDER; n++)
+		cluster->moments[n] = 0.0;
+
+	for (int p = first; p < last; p++)
+	{
+		cluster->minAll = impacts[p].minP > cluster->minAll ? impacts[p].minP : cluster->minAll;
+		cluster->maxAll = impacts[p].maxP < cluster->maxAll ? impacts[p].maxP : cluster->maxAll;
+		cluster->minAny = impacts[p].minP < cluster->minAny ? impacts[p].minP : cluster->minAny;
+		cluster->maxAny = impacts[p].maxP > cluster->maxAny ? impacts[p].maxP : cluster->maxAny;
+
+		double delta = impacts[p].position - cluster->center;
+		double term = impacts[p].energy;
+		for (int n = 0; n <= FAR_FIELD_ORDER; n++)
+		{
+			cluster->moments[n] += term;
+			term *= delta;
+		}
+	}
+
+	if (last - first <= FAR_FIELD_LEAF_SIZE)
+	{
+		cluster->left = cluster->right = -1;
+	}
+	else
+	{
+		int middle = first + (last - first) / 2;
+		int left = build_cluster(farField, first, middle);
+		int right = build_cluster(farField, middle, last);
+		farField->clusters[c].left = left;
+		farField->clusters[c].right = right;
+	}
+	return c;
+}
+
+/*
+ * Function: Build the far-field clusters of the particles of a storm,
+ * and update the active range of the layer
+ */
+void build_far_field(FarField *farField, int layer_size, Storm *storm,
+		int *minL, int *maxL)
+{
+	int impactsStart[2], stormMinL[1], stormMaxL[1];
+	farField->impacts = compute_impacts(layer_size, storm, 1, impactsStart,
+			stormMinL, stormMaxL, minL, maxL);
+	farField->clusters = (Cluster *) malloc(sizeof(Cluster) * (2 * storm->size + 1));
+	if (farField->clusters == NULL)
+	{
+		fprintf(stderr, "Error: Allocating the clusters memory\n");
+		exit(EXIT_FAILURE);
+	}
+	farField->num_clusters = 0;
+
+	qsort(farField->impacts, storm->size, sizeof(Impact), compare_impacts);
+
+	if (storm->size > 0)
+		build_cluster(farField, 0, storm->size);
+
+	/**
+	 * The remainder of the expansion is bounded by
+	 * |binomial(-1/2, ORDER + 1)| * theta^(ORDER + 1) * sqrt(1 + 2 * theta)
+	 * times the sum of the absolute energies, with theta <= 1/2
+	 */
+	double coefficient = 1.0;
+	for (int n = 1; n <= FAR_FIELD_ORDER + 1; n++)
+		coefficient *= (2.0 * n - 1) / (2.0 * n);
+
+	farField->theta = pow(far_field_tolerance / (coefficient * sqrt(2.0)),
+			1.0 / (FAR_FIELD_ORDER + 1));
+	if (farField->theta > 0.5)
+		farField->theta = 0.5;
+}
+
+void free_far_field(FarField *farField)
+{
+	free(farField->impacts);
+	free(farField->clusters);
+}
+
+/*
+ * Function: Energy that reaches the k-th cell from a far cluster, with the
+ * Taylor expansion of the attenuation around the center of the cluster
+ */
+double far_field_energy(Cluster *cluster, int layer_size, int k)
+{
+	double distance = k - cluster->center;
+	double sign = 1.0;
+	if (distance < 0)
+		distance = -distance;
+	else
+		sign = -1.0;
+
+	double u = 1.0 / (distance + 1.0);
+	double derivative = sqrt(u);
+	double factor = 1.0;
+	double energy = 0.0;
+	for (int n = 0; n <= FAR_FIELD_ORDER; n++)
+	{
+		energy += derivative * factor * cluster->moments[n];
+		derivative *= -(2.0 * n + 1) / (2.0 * n + 2) * u;
+		factor *= sign;
+	}
+	return energy / layer_size;
+}
+
+/*
+ * Function: Add the impacts energies of a storm to the layer with the far-field
+ * approximation. Must be called by all the threads of the team.
+ */
+void bombard_far_field(energy_t *layer, int layer_size, FarField *farField)
+{
+	if (farField->num_clusters == 0)
+		return;
+
+	Cluster *clusters = farField->clusters;
+	Impact *impacts = farField->impacts;
+	int begin = clusters[0].minAny, end = clusters[0].maxAny;
+
+	int *farList = (int *) malloc(sizeof(int) * farField->num_clusters);
+	int *nearList = (int *) malloc(sizeof(int) * farField->num_clusters);
+	int *stack = (int *) malloc(sizeof(int) * farField->num_clusters);
+	if (farList == NULL || nearList == NULL || stack == NULL)
+	{
+		fprintf(stderr, "Error: Allocating the clusters lists memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	double threadMaxError = 0.0;
+	long threadViolations = 0;
+
+	#pragma omp for schedule(dynamic)
+	for (int t0 = begin; t0 < end; t0 += FAR_FIELD_TILE_SIZE)
+	{
+		int t1 = t0 + FAR_FIELD_TILE_SIZE < end ? t0 + FAR_FIELD_TILE_SIZE : end;
+
+		/* 1. Classify the clusters as far or near to the cells [t0, t1) */
+		int numFar = 0, numNear = 0, top = 0;
+		stack[top++] = 0;
+		while (top > 0)
+		{
+			Cluster *cluster = &clusters[stack[--top]];
+			if (t1 <= cluster->minAny || t0 >= cluster->maxAny)
+				continue;
+
+			double lowest = impacts[cluster->first].position;
+			double highest = impacts[cluster->last - 1].position;
+			double distance = -1.0;
+			if (t1 - 1 < lowest)
+				distance = cluster->center - (t1 - 1);
+			else if (t0 > highest)
+				distance = t0 - cluster->center;
+
+			if (t0 >= cluster->minAll && t1 <= cluster->maxAll && distance >= 0
+					&& cluster->halfWidth <= farField->theta * (distance - cluster->halfWidth + 1))
+				farList[numFar++] = cluster - clusters;
+			else if (cluster->left < 0)
+				nearList[numNear++] = cluster - clusters;
+			else
+			{
+				stack[top++] = cluster->left;
+				stack[top++] = cluster->right;
+			}
+		}
+
+		/* 2. Add the energies of the far clusters and of the particles of the near ones */
+		for (int k = t0; k < t1; k++)
+		{
+			double energy = 0.0;
+			for (int f = 0; f < numFar; f++)
+				energy += far_field_energy(&clusters[farList[f]], layer_size, k);
+
+			for (int f = 0; f < numNear; f++)
+				for (int p = clusters[nearList[f]].first; p < clusters[nearList[f]].last; p++)
+					if (k >= impacts[p].minP && k < impacts[p].maxP)
+						energy += attenuated_energy(layer_size, k, impacts[p].position, impacts[p].energy);
+
+			if (far_field_check)
+			{
+				double exact = 0.0, magnitude = 0.0;
+				for (int p = 0; p < clusters[0].last; p++)
+				{
+					if (k >= impacts[p].minP && k < impacts[p].maxP)
+					{
+						energy_t energy_k = attenuated_energy(layer_size, k, impacts[p].position, impacts[p].energy);
+						exact += energy_k;
+						magnitude += fabs(energy_k);
+					}
+				}
+
+				/* The exact energies are rounded to single precision */
+				double error = fabs(energy - exact);
+				if (error > (far_field_tolerance + 4 * FLT_EPSILON) * magnitude)
+					threadViolations++;
+				if (magnitude > 0 && error / magnitude > threadMaxError)
+					threadMaxError = error / magnitude;
+			}
+
+			layer[k] = layer[k] + (energy_t) energy;
+		}
+	}
+
+	if (far_field_check)
+	{
+		#pragma omp critical
+		{
+			far_field_violations += threadViolations;
+			if (threadMaxError > far_field_max_error)
+				far_field_max_error = threadMaxError;
+		}
+	}
+
+	free(farList);
+	free(nearList);
+	free(stack);
+}
+#endif
+
+/*
+ * MAIN PROGRAM
+ */
+int main(int argc, char *argv[])
+{
+	n_threads = omp_get_max_threads();
+
+	short optargc = processOptions(argc, argv);
+
+	if (n_threads <= 0)
+	{
+		fprintf(stderr, "Invalid number of threads! %d\n", n_threads);
+		exit(EXIT_FAILURE);
+	}
+
+	if (threshold <= 0.0)
+	{
+		fprintf(stderr, "Invalid threshold! %f\n", threshold);
+		exit(EXIT_FAILURE);
+	}
+
+	if (temporal_block <= 0)
+	{
+		fprintf(stderr, "Invalid temporal block size! %d\n", temporal_block);
+		exit(EXIT_FAILURE);
+	}
+
+	if (pipeline_threads < 0 || (pipeline_threads > 0 && temporal_block > 1))
+	{
+		fprintf(stderr, "Invalid number of pipeline threads! %d\n", pipeline_threads);
+		exit(EXIT_FAILURE);
+	}
+
+	if (far_field_tolerance < 0.0 || (far_field_tolerance > 0.0 && (temporal_block > 1 || pipeline_threads > 0)))
+	{
+		fprintf(stderr, "Invalid far-field tolerance! %f\n", far_field_tolerance);
+		exit(EXIT_FAILURE);
+	}
+
+	if (top_k < 0)
+	{
+		fprintf(stderr, "Invalid number of local maxima! %d\n", top_k);
+		exit(EXIT_FAILURE);
+	}
+
+	if (snapshot_every <= 0 || snapshot_block < 0
+			|| (snapshot_prefix != NULL && (temporal_block > 1 || pipeline_threads > 0)))
+	{
+		fprintf(stderr, "Invalid snapshot options! %d %d\n", snapshot_every, snapshot_block);
+		exit(EXIT_FAILURE);
+	}
+
+	if (cache_dir != NULL && resume_file != NULL)
+	{
+		fprintf(stderr, "Error: The result cache can not be used resuming from a checkpoint\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* 1.1. Read arguments */
+	if (argc - optargc < 3)
+	{
+		fprintf(stderr,
+				"Usage: %s <options> <size> <storm_1_file> [ <storm_i_file> ] ... \n",
+				argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	int layer_size = atoi(argv[optargc + 1]);
+
+	/* A storm has less local maxima than cells */
+	if (top_k > layer_size)
+		top_k = layer_size;
+	int num_storms = argc - optargc - 2;
+	Storm storms[num_storms];
+
+	/* 1.2. Read storms information */
 	for (int i = 2 + optargc; i < argc; i++)
 		storms[i - (2 + optargc)] = read_storm_file(argv[i]);
 
-	/* 1.3. Intialize maximum levels to zero */
-	energy_t maximum[num_storms];
-	int positions[num_storms];
-	for (int i = 0; i < num_storms; i++)
+	/* 1.3. Read the state saved by a previous run, only the new storms are simulated */
+	CheckpointHeader checkpoint;
+	FILE *fcheck = NULL;
+	int prev_storms = 0;
+	if (resume_file != NULL)
+	{
+		fcheck = open_checkpoint(resume_file, &checkpoint);
+		if (checkpoint.layer_size != layer_size || !same_threshold(checkpoint.threshold))
+		{
+			fprintf(stderr,
+					"Error: Checkpoint file %s was saved with size %d and threshold %.17g, not %d and %.17g\n",
+					resume_file, checkpoint.layer_size, checkpoint.threshold, layer_size, threshold);
+			exit(EXIT_FAILURE);
+		}
+		prev_storms = checkpoint.num_storms;
+	}
+
+	/* 1.3.1. Serve the longest cached prefix of the storms, only the rest are simulated */
+	unsigned long long cache_key[num_storms], cache_check[num_storms];
+	int cached_storms = 0;
+	if (cache_dir != NULL && num_storms > 0)
+		cache_keys(layer_size, storms, num_storms, cache_key, cache_check);
+
+	/**
+	 * The entries have no local maxima nor snapshots, the runs that report
+	 * them simulate all the storms (and store their results)
+	 */
+	if (cache_dir != NULL && num_storms > 0 && top_k == 0 && snapshot_prefix == NULL)
+		cached_storms = lookup_cache(layer_size, num_storms, cache_key, cache_check,
+				checkpoint_file != NULL, &checkpoint, &fcheck);
+	if (cached_storms > 0)
+	{
+		for (int i = 0; i < cached_storms; i++)
+			free(storms[i].posval);
+		for (int i = cached_storms; i < num_storms; i++)
+			storms[i - cached_storms] = storms[i];
+
+		prev_storms = cached_storms;
+		num_storms -= cached_storms;
+	}
+	int total_storms = prev_storms + num_storms;
+
+	/* 1.4. Intialize maximum levels to zero */
+	energy_t maximum[total_storms];
+	int positions[total_storms];
+	for (int i = 0; i < total_storms; i++)
 	{
 		maximum[i] = 0.0f;
 		positions[i] = 0;
 	}
 
+	if (fcheck != NULL)
+		read_checkpoint_results(fcheck, resume_file != NULL ? resume_file : cache_dir,
+				&checkpoint, maximum, positions);
+
+	/* 1.5. The highest local maxima of each storm, the ones of resumed storms are not known */
+	LocalMaximum *top_maxima = (LocalMaximum *) malloc(sizeof(LocalMaximum) * ((size_t) total_storms * top_k + 1));
+	int top_sizes[total_storms];
+	if (top_maxima == NULL)
+	{
+		fprintf(stderr, "Error: Allocating the local maxima memory\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < total_storms; i++)
+		top_sizes[i] = 0;
+
+	start_progress(num_storms);
+	start_snapshots(layer_size);
+
 	/* 2. Begin time measurement */
 	double ttotal = cp_Wtime();
 
 	/* START: Do NOT optimize/parallelize the code of the main program above this point */
 
-	/* 3. Allocate memory for the layer and initialize to zero */
-	energy_t *layer = (energy_t *) malloc(sizeof(energy_t) * layer_size);
+	/**
+	 * 3. Allocate memory for the layer, initialized to zero.
+	 * The additional cell is read by the maximum search when maxL == layer_size
+	 */
+	energy_t *layer = allocate_layer(layer_size + 1);
 
 	#ifdef ENERGY_RELAXATION_BEFORE
-	energy_t *layer_copy = (energy_t *) malloc(sizeof(energy_t) * layer_size);
+	energy_t *layer_copy = allocate_layer(layer_size + 1);
 	#endif
 
 	if (layer == NULL)
@@ -369,17 +2212,11 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	#pragma omp parallel num_threads(n_threads) if(n_threads > 1)
+	if (fcheck != NULL)
 	{
-		#pragma omp for simd
-		for (int kk = 0; kk < layer_size; kk++)
-		{
-			layer[kk] = 0.0f;
-
-			#ifdef ENERGY_RELAXATION_BEFORE
-			layer_copy[kk] = 0.00f;
-			#endif
-		}
+		read_checkpoint_layer(fcheck, resume_file != NULL ? resume_file : cache_dir,
+				&checkpoint, layer);
+		fclose(fcheck);
 	}
 
 	/**
@@ -391,136 +2228,214 @@ int main(int argc, char *argv[])
 	#else
 	int maxL = layer_size, minL = 0;
 	#endif
+
+	if (resume_file != NULL || cached_storms > 0)
+	{
+		minL = checkpoint.minL;
+		maxL = checkpoint.maxL;
+	}
+
 	/* 4. Storms simulation */
-	for (int i = 0; i < num_storms; i++)
+	#if !defined(ENERGY_RELAXATION_BEFORE) && !defined(ENERGY_BOMBARDMENT_BEFORE)
+	if (temporal_block > 1 && num_storms > 0)
 	{
-		int position = 0;
-		/**
-		 * The range that a particle will affect in the layer array 
-		 */
-		int maxP = layer_size, minP = 0;
+		energy_t *layer_next = allocate_layer(layer_size + 1);
+		if (layer_next == NULL)
+		{
+			fprintf(stderr, "Error: Allocating the layer memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		simulate_storms_blocked(layer, layer_next, layer_size, storms, num_storms,
+				temporal_block, &minL, &maxL, &maximum[prev_storms], &positions[prev_storms],
+				&top_maxima[(size_t) prev_storms * top_k], &top_sizes[prev_storms]);
 
-		energy_t energy;
-		#pragma omp parallel num_threads(n_threads) if(n_threads > 1 && layer_size > MIN_PARALLEL_THRESHOLD)
+		release_layer(layer_next, layer_size + 1);
+	}
+	else if (pipeline_threads > 0 && num_storms > 0)
+	{
+		energy_t *layer_next = allocate_layer(layer_size + 1);
+		energy_t *delta_even = allocate_layer(layer_size + 1);
+		energy_t *delta_odd = allocate_layer(layer_size + 1);
+		if (layer_next == NULL || delta_even == NULL || delta_odd == NULL)
+		{
+			fprintf(stderr, "Error: Allocating the layer memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		simulate_storms_pipelined(layer, layer_next, delta_even, delta_odd,
+				layer_size, storms, num_storms, pipeline_threads, &minL, &maxL,
+				&maximum[prev_storms], &positions[prev_storms],
+				&top_maxima[(size_t) prev_storms * top_k], &top_sizes[prev_storms]);
+
+		release_layer(layer_next, layer_size + 1);
+		release_layer(delta_even, layer_size + 1);
+		release_layer(delta_odd, layer_size + 1);
+	}
+	else
+	#endif
+	{
+		for (int i = 0; i < num_storms; i++)
 		{
-			/* 4.1. Add impacts energies to layer cells */
-			/* For each particle */
-			for (int j = 0; j < storms[i].size; j++)
+			int position = 0;
+			/**
+			 * The range that a particle will affect in the layer array 
+			 */
+			int maxP = layer_size, minP = 0;
+
+			energy_t energy;
+			long stormCells = 0;
+			SnapshotBuffer *snapshotBuffer = NULL;
+			#if !defined(ENERGY_RELAXATION_BEFORE) && !defined(ENERGY_BOMBARDMENT_BEFORE)
+			FarField farField;
+			#endif
+			#pragma omp parallel num_threads(n_threads) if(n_threads > 1 && layer_size > MIN_PARALLEL_THRESHOLD)
 			{
-				#pragma omp single
+				/* 4.1. Add impacts energies to layer cells */
+				#if !defined(ENERGY_RELAXATION_BEFORE) && !defined(ENERGY_BOMBARDMENT_BEFORE)
+				if (far_field_tolerance > 0.0)
 				{
-					/* Get impact energy (expressed in thousandths) */
-					energy = (energy_t) storms[i].posval[j * 2 + 1] * 1000;
-					/* Get impact position */
-					position = storms[i].posval[j * 2];
-
-					#ifndef ENERGY_BOMBARDMENT_BEFORE
+					#pragma omp single
+					{
+						build_far_field(&farField, layer_size, &storms[i], &minL, &maxL);
+						stormCells = impacts_cells(farField.impacts, 0, storms[i].size);
+					}
 
-					long double atenuation = energy / threshold;
-					unsigned long long distanceMax = (unsigned long long) atenuation*atenuation;
+					bombard_far_field(layer, layer_size, &farField);
 
-					//check overflow
-					if(atenuation > 1.0 && distanceMax == 0)
-						distanceMax = layer_size;
+					#pragma omp single
+					free_far_field(&farField);
+				}
+				else
+				#endif
+				/* For each particle */
+				for (int j = 0; j < storms[i].size; j++)
+				{
+					#pragma omp single
+					{
+						/* Get impact energy (expressed in thousandths) */
+						energy = (energy_t) storms[i].posval[j * 2 + 1] * 1000;
+						/* Get impact position */
+						position = storms[i].posval[j * 2];
 
-					//to avoid underflow, since distanceMax is an unsigned type
-					if(distanceMax > 0)
-						distanceMax--;
+						#ifndef ENERGY_BOMBARDMENT_BEFORE
 
-					//to avoid overflows/undeflows
-					maxP = distanceMax >= layer_size ? layer_size : position + distanceMax;
-					minP = distanceMax >= position ? 0 : position - distanceMax;
+						particle_range(layer_size, position, energy, &minP, &maxP);
+						stormCells += maxP - minP;
 
-					/**
-					 * maxP and minP can be out of bounds
-					 */
-					maxP = maxP >= layer_size ? layer_size : maxP;
-					minP = minP >= layer_size ? layer_size : minP;
+						maxL = maxP > maxL ? maxP : maxL;
+						minL = minP < minL ? minP : minL;
 
-					maxL = maxP > maxL ? maxP : maxL;
-					minL = minP < minL ? minP : minL;
+						//fprintf(stderr, "%d, %d, %d, %d, %llu\n", maxL, minL, maxP, minP, distanceMax);
 
-					//fprintf(stderr, "%d, %d, %d, %d, %llu\n", maxL, minL, maxP, minP, distanceMax);
+						assert(maxL >= minL);
+						assert(maxL >= maxP && minL <= minP);
+						assert(minL <= layer_size && minL >= 0);
+						assert(maxL <= layer_size && maxL >= 0);
+						assert(maxP <= layer_size && maxP >= 0);
+						assert(minP <= layer_size && minP >= 0);
 
-					assert(maxL >= minL);
-					assert(maxL >= maxP && minL <= minP);
-					assert(minL <= layer_size && minL >= 0);
-					assert(maxL <= layer_size && maxL >= 0);
-					assert(maxP <= layer_size && maxP >= 0);
-					assert(minP <= layer_size && minP >= 0);
+						#endif
+					}
 
-					#endif
+					/* For each cell in the layer */
+					/* 4.2.2. Update layer using the ancillary values.
+					Skip updating the first and last positions */
+					#pragma omp for
+					for (int k = minP; k < maxP; k++)
+					{
+						/* Update the energy value for the cell */
+						update(layer, layer_size, k, position, energy);
+					}
 				}
 
-				/* For each cell in the layer */
-				/* 4.2.2. Update layer using the ancillary values.
-				Skip updating the first and last positions */
-				#pragma omp for
-				for (int k = minP; k < maxP; k++)
+					/* 4.2. Energy relaxation between storms */
+				#ifndef ENERGY_RELAXATION_BEFORE //code below is after
+
+					int interval = maxL - minL;
+					assert(interval >= 0);
+					assert(minL + interval <= layer_size);
+					if(interval > 0)
+						energy_relaxation(&layer[minL], interval);
+
+					/* The search reads the cells relaxed by the neighbour threads */
+					#pragma omp barrier
+
+				#else //code below is before
+					/* 4.2.1. Copy values to the ancillary array */
+					#pragma omp for
+					for (int k = 0; k < layer_size; k++)
+						layer_copy[k] = layer[k];
+
+					/* 4.2.2. Update layer using the ancillary values.
+					Skip updating the first and last positions */
+					#pragma omp for
+					for (int k = 1; k < layer_size - 1; k++)
+						layer[k] = (layer_copy[k - 1] + layer_copy[k] + layer_copy[k + 1])
+								/ 3;
+
+				#endif
+
+				/* 4.3. Locate the maximum value in the layer, and its position */
+				int maxk = minL;
+				int topCapacity;
+				LocalMaximum *threadTop = allocate_local_maxima(1, maxL - minL, &topCapacity);
+				int threadTopSize = 0;
+				#pragma omp for nowait
+				for (int k = minL + 1; k < maxL - 1; k++)
 				{
-					/* Update the energy value for the cell */
-					update(layer, layer_size, k, position, energy);
-				}
-			}
-
-				/* 4.2. Energy relaxation between storms */
-			#ifndef ENERGY_RELAXATION_BEFORE //code below is after
-
-				int interval = maxL - minL;
-				assert(interval >= 0);
-				assert(minL + interval <= layer_size);
-				if(interval > 0)
-					energy_relaxation(&layer[minL], interval);
-
-			#else //code below is before
-				/* 4.2.1. Copy values to the ancillary array */
-				#pragma omp for
-				for (int k = 0; k < layer_size; k++)
-					layer_copy[k] = layer[k];
+					/* Check it only if it is a local maximum */
+					if (layer[k] > layer[k - 1] && layer[k] > layer[k + 1])
+					{
+						if (layer[k] > layer[maxk])
+						{
+							maxk = k;
+						}
 
-				/* 4.2.2. Update layer using the ancillary values.
-				Skip updating the first and last positions */
-				#pragma omp for
-				for (int k = 1; k < layer_size - 1; k++)
-					layer[k] = (layer_copy[k - 1] + layer_copy[k] + layer_copy[k + 1])
-							/ 3;
+						if (top_k > 0)
+							push_local_maximum(threadTop, &threadTopSize, topCapacity, k, layer[k]);
+					}
+				}
 
-			#endif
+				/**
+				 * The energy values on the layer can be always rising 
+				 * or always falling
+				 */
+				if(maxk != minL)
+					maxk = layer[maxL] > layer[minL] ? maxL : minL;
 
-			/* 4.3. Locate the maximum value in the layer, and its position */
-			int maxk = minL;
-			#pragma omp for nowait
-			for (int k = minL + 1; k < maxL - 1; k++)
-			{
-				/* Check it only if it is a local maximum */
-				if (layer[k] > layer[k - 1] && layer[k] > layer[k + 1])
+				#pragma omp critical
 				{
-					if (layer[k] > layer[maxk])
+					if (layer[maxk] > maximum[prev_storms + i])
 					{
-						maxk = k;
+						maximum[prev_storms + i] = layer[maxk];
+						positions[prev_storms + i] = maxk;
 					}
-				}
-			}
 
-			/**
-			 * The energy values on the layer can be always rising 
-			 * or always falling
-			 */
-			if(maxk != minL)
-				maxk = layer[maxL] > layer[minL] ? maxL : minL;
+					merge_local_maxima(&top_maxima[(size_t) (prev_storms + i) * top_k],
+							&top_sizes[prev_storms + i], top_k, threadTop, threadTopSize);
+				}
+				free(threadTop);
 
-			#pragma omp critical
-			{
-				if (layer[maxk] > maximum[i])
+				#pragma omp single
 				{
-					maximum[i] = layer[maxk];
-					positions[i] = maxk;
+					progress_storm_done(storms[i].size, stormCells);
+					free(storms[i].posval);
 				}
-			}
 
-			#pragma omp single
-			{
-				free(storms[i].posval);
+				/* 4.4. Copy the layer for the snapshot writer */
+				if (snapshot_selected(prev_storms + i, total_storms))
+				{
+					#pragma omp single
+					snapshotBuffer = acquire_snapshot_buffer();
+
+					#pragma omp for
+					for (int k = minL; k < maxL; k++)
+						snapshotBuffer->cells[k] = layer[k];
+
+					#pragma omp single nowait
+					submit_snapshot_buffer(snapshotBuffer, prev_storms + i, minL, maxL);
+				}
 			}
 		}
 	}
@@ -529,10 +2444,13 @@ int main(int argc, char *argv[])
 	/* 5. End time measurement */
 	ttotal = cp_Wtime() - ttotal;
 
+	stop_progress();
+	stop_snapshots();
+
 	/* 6. DEBUG: Plot the result (only for layers up to 35 points) */
 	#ifdef DEBUG
 	if(!csv)
-		debug_print( layer_size, layer, positions, maximum, num_storms, storms);
+		debug_print( layer_size, layer, positions, maximum, total_storms, storms);
 	#endif
 
 	/* 7. Results output, used by the Tablon online judge software */
@@ -545,14 +2463,51 @@ int main(int argc, char *argv[])
 	/* 7.2. Print the maximum levels */
 	printfColor(BLUE, "Results:\n")
 
-	for (int i = 0; i < num_storms; i++)
+	for (int i = 0; i < total_storms; i++)
 		printf("%d%s%f\n", positions[i], separator, maximum[i]);
 	printf("\n");
 
-	free(layer);
+	/* 7.3. Print the highest local maxima of each simulated storm */
+	if (top_k > 0)
+	{
+		printfColor(BLUE, "Top maxima:\n")
+
+		for (int i = prev_storms; i < total_storms; i++)
+		{
+			LocalMaximum *top = &top_maxima[(size_t) i * top_k];
+			qsort(top, top_sizes[i], sizeof(LocalMaximum), compare_local_maxima);
+			for (int m = 0; m < top_sizes[i]; m++)
+				printf("%d%s%d%s%d%s%f\n", i, separator, m + 1, separator,
+						top[m].position, separator, top[m].value);
+		}
+		printf("\n");
+	}
+
+	#if !defined(ENERGY_RELAXATION_BEFORE) && !defined(ENERGY_BOMBARDMENT_BEFORE)
+	if (far_field_tolerance > 0.0 && far_field_check)
+	{
+		fprintf(stderr, "Far-field check: maximum relative error %e, tolerance %e, %ld cells out of the bound\n",
+				far_field_max_error, far_field_tolerance, far_field_violations);
+		if (far_field_violations > 0)
+			exit(EXIT_FAILURE);
+	}
+	#endif
+
+	/* 8. Save the simulation state, a later run can resume from it */
+	if (checkpoint_file != NULL)
+		save_checkpoint(checkpoint_file, layer, layer_size, minL, maxL,
+				maximum, positions, total_storms);
+
+	/* 8.1. Store the results in the cache, unless they were all served from it */
+	if (cache_dir != NULL && num_storms > 0)
+		store_cache(cache_key[total_storms - 1], cache_check[total_storms - 1], layer,
+				layer_size, minL, maxL, maximum, positions, total_storms);
+
+	release_layer(layer, layer_size + 1);
+	free(top_maxima);
 
 	#ifdef ENERGY_RELAXATION_BEFORE
-	free(layer_copy);
+	release_layer(layer_copy, layer_size + 1);
 	#endif
 
 	/**
@@ -0,0 +1,211 @@
+/*
+ * Simplified simulation of high-energy particle storms
+ *
+ * Storm files generator.
+ *
+ * Writes a storm file (the number of particles in the first line, then
+ * one "position energy" line per particle) with the particles distributed
+ * on a layer of the given size:
+ *
+ *  uniform   Uniform positions and uniform energies
+ *  clustered Positions around a few random centers, uniform energies
+ *  powerlaw  Uniform positions, energies with a power-law (Pareto) distribution
+ *
+ * The same seed always generates the same file.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+typedef enum
+{
+	UNIFORM, CLUSTERED, POWERLAW
+} distribution_t;
+
+distribution_t distribution = UNIFORM;
+unsigned long long seed = 1;
+int min_energy = 500000;
+int max_energy = 1000000;
+int num_clusters = 8;
+double alpha = 2.5;
+
+/* Pseudo-random generator (splitmix64), independent of the C library */
+unsigned long long next_random()
+{
+	unsigned long long z = (seed += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+/* Uniform value in [0, 1) */
+double next_uniform()
+{
+	return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Normal value with mean 0 and deviation 1 (Box-Muller) */
+double next_normal()
+{
+	double u = 1.0 - next_uniform();
+	double v = next_uniform();
+	return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+int uniform_energy()
+{
+	return min_energy + (int) (next_uniform() * (max_energy - min_energy + 1));
+}
+
+int powerlaw_energy()
+{
+	double energy = min_energy * pow(1.0 - next_uniform(), -1.0 / (alpha - 1.0));
+	return energy > max_energy ? max_energy : (int) energy;
+}
+
+short processOptions(int argc, char *argv[])
+{
+	short optargc = 0;
+	int c;
+	while ((c = getopt(argc, argv, "d:s:e:E:n:a:")) != -1)
+	{
+		switch (c)
+		{
+			case 'd':
+			{
+				if (strcmp(optarg, "uniform") == 0)
+					distribution = UNIFORM;
+				else if (strcmp(optarg, "clustered") == 0)
+					distribution = CLUSTERED;
+				else if (strcmp(optarg, "powerlaw") == 0)
+					distribution = POWERLAW;
+				else
+				{
+					fprintf(stderr, "Invalid distribution! %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+
+				optargc++;
+				break;
+			}
+			case 's':
+			{
+				seed = strtoull(optarg, NULL, 10);
+
+				optargc++;
+				break;
+			}
+			case 'e':
+			{
+				min_energy = atoi(optarg);
+
+				optargc++;
+				break;
+			}
+			case 'E':
+			{
+				max_energy = atoi(optarg);
+
+				optargc++;
+				break;
+			}
+			case 'n':
+			{
+				num_clusters = atoi(optarg);
+
+				optargc++;
+				break;
+			}
+			case 'a':
+			{
+				alpha = atof(optarg);
+
+				optargc++;
+				break;
+			}
+			default:
+				exit(EXIT_FAILURE);
+		}
+		optargc++;
+	}
+	return optargc;
+}
+
+int main(int argc, char *argv[])
+{
+	short optargc = processOptions(argc, argv);
+
+	if (argc - optargc != 4)
+	{
+		fprintf(stderr,
+				"Usage: %s [ -d uniform|clustered|powerlaw ] [ -s seed ] [ -e min_energy ] [ -E max_energy ]"
+				" [ -n clusters ] [ -a alpha ] <layer_size> <particles> <storm_file>\n",
+				argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	int layer_size = atoi(argv[optargc + 1]);
+	int particles = atoi(argv[optargc + 2]);
+	char *fname = argv[optargc + 3];
+
+	if (layer_size <= 0 || particles < 0)
+	{
+		fprintf(stderr, "Invalid layer size or number of particles! %d %d\n", layer_size, particles);
+		exit(EXIT_FAILURE);
+	}
+
+	if (min_energy <= 0 || max_energy < min_energy || num_clusters <= 0 || alpha <= 1.0)
+	{
+		fprintf(stderr, "Invalid distribution parameters!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	FILE *fstorm = fopen(fname, "w");
+	if (fstorm == NULL)
+	{
+		fprintf(stderr, "Error: Opening storm file %s\n", fname);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Centers and spread of the clusters */
+	int centers[num_clusters];
+	for (int c = 0; c < num_clusters; c++)
+		centers[c] = (int) (next_uniform() * layer_size);
+	double spread = (double) layer_size / (10 * num_clusters);
+
+	fprintf(fstorm, "%d\n", particles);
+	for (int p = 0; p < particles; p++)
+	{
+		int position, energy;
+		switch (distribution)
+		{
+			case CLUSTERED:
+			{
+				int c = (int) (next_uniform() * num_clusters);
+				position = centers[c] + (int) lround(next_normal() * spread);
+				position = position < 0 ? 0 : (position >= layer_size ? layer_size - 1 : position);
+				energy = uniform_energy();
+				break;
+			}
+			case POWERLAW:
+				position = (int) (next_uniform() * layer_size);
+				energy = powerlaw_energy();
+				break;
+			default:
+				position = (int) (next_uniform() * layer_size);
+				energy = uniform_energy();
+				break;
+		}
+		fprintf(fstorm, "%d %d\n", position, energy);
+	}
+
+	if (fclose(fstorm) != 0)
+	{
+		fprintf(stderr, "Error: Writing storm file %s\n", fname);
+		exit(EXIT_FAILURE);
+	}
+
+	return 0;
+}